@@ -0,0 +1,243 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "afalg.h"
+
+#include <optional>
+#include <span>
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if_alg.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+#include "common.h"
+
+namespace {
+// How much to splice at a time: as much as a pipe holds, if it lets us make
+// it this big.
+constexpr int kPipeSize = 1 << 20;
+
+// The bound AF_ALG socket for each algorithm, from which one socket per file
+// is accepted; -1 before trying, and -2 if the kernel does not have it.
+struct TransformSlot {
+    std::atomic<int> fd = -1;
+};
+TransformSlot transforms[kMaxAlgorithms];
+
+int Transform(AlgorithmId algorithm) {
+    const int fd = transforms[algorithm].fd.load(std::memory_order_acquire);
+    if (fd != -1) return fd;
+
+    static std::mutex mu;
+    const std::lock_guard<std::mutex> l(mu);
+    if (transforms[algorithm].fd != -1) return transforms[algorithm].fd;
+    int ret = -2;
+    const std::string_view name = GetAlgorithm(algorithm).kernel;
+    struct sockaddr_alg addr = {
+        .salg_family = AF_ALG, .salg_type = "hash", .salg_feat = 0,
+        .salg_mask = 0, .salg_name = {},
+    };
+    if (!name.empty() && name.size() < sizeof(addr.salg_name)) {
+        memcpy(addr.salg_name, name.data(), name.size());
+        const int sock = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (sock >= 0) {
+            if (bind(sock, reinterpret_cast<sockaddr*>(&addr),
+                     sizeof(addr)) == 0) {
+                ret = sock;
+            } else {
+                close(sock);
+            }
+        }
+    }
+    transforms[algorithm].fd.store(ret, std::memory_order_release);
+    return ret;
+}
+
+// A pipe, which the calling thread keeps for as long as it runs.
+struct Pipe {
+    Pipe() {
+        if (pipe2(fds, O_CLOEXEC)) DIE("pipe2");
+        fcntl(fds[1], F_SETPIPE_SZ, kPipeSize);
+        size = fcntl(fds[1], F_GETPIPE_SZ);
+        if (size <= 0) DIE("F_GETPIPE_SZ");
+    }
+    ~Pipe() {
+        close(fds[0]);
+        close(fds[1]);
+    }
+    Pipe(const Pipe&) = delete;
+    Pipe& operator=(const Pipe&) = delete;
+
+    int rfd() const { return fds[0]; }
+    int wfd() const { return fds[1]; }
+
+    int fds[2];
+    int size;
+};
+
+// The calling thread's pipes. A deque, because pipes can not move.
+thread_local std::deque<Pipe> thread_pipes;
+
+// Returns the calling thread's index'th pipe.
+Pipe& ThreadPipe(size_t index) {
+    while (thread_pipes.size() <= index) thread_pipes.emplace_back();
+    return thread_pipes[index];
+}
+
+// Moves len bytes from the pipe rfd into sock. Returns false on error.
+bool SpliceAll(int rfd, int sock, size_t len) {
+    while (len > 0) {
+        const ssize_t moved =
+            splice(rfd, nullptr, sock, nullptr, len, SPLICE_F_MORE);
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved <= 0) return false;
+        len -= moved;
+    }
+    return true;
+}
+
+// Moves the len bytes at the head of in, which came from fd at offset, into
+// sock through the empty pipe copy, leaving them in in. Returns false on
+// error.
+bool CopyAll(const Pipe& in, const Pipe& copy, int sock, int fd,
+             loff_t offset, size_t len) {
+    // tee only copies references to the pages, and copies everything when
+    // copy can hold as much as in. It always starts at the head of in, so
+    // if it ever comes up short, the rest is spliced from fd again.
+    ssize_t teed;
+    do {
+        teed = tee(in.rfd(), copy.wfd(), len, 0);
+    } while (teed < 0 && errno == EINTR);
+    if (teed < 0) return false;
+    if (!SpliceAll(copy.rfd(), sock, teed)) return false;
+    offset += teed;
+    len -= teed;
+    while (len > 0) {
+        const ssize_t moved =
+            splice(fd, &offset, copy.wfd(), nullptr, len, SPLICE_F_MOVE);
+        if (moved < 0 && errno == EINTR) continue;
+        if (moved <= 0) return false;
+        if (!SpliceAll(copy.rfd(), sock, moved)) return false;
+        len -= moved;
+    }
+    return true;
+}
+}  // namespace
+
+bool KernelCanHash(std::span<const AlgorithmId> algorithms) {
+    for (const AlgorithmId algorithm : algorithms) {
+        if (Transform(algorithm) < 0) return false;
+    }
+    return true;
+}
+
+HashResult KernelHash(int fd, std::span<const AlgorithmId> algorithms,
+                      ReadThrottle* throttle, CacheAdvice* cache,
+                      std::optional<DigestList>* digests) {
+    digests->reset();
+    if (algorithms.empty() || !KernelCanHash(algorithms)) {
+        return HashResult::OK;
+    }
+
+    // A socket per algorithm for this file.
+    FixedList<int, kMaxAlgorithms> socks;
+    const Cleanup closer([&socks]() {
+        for (const int sock : socks) close(sock);
+    });
+    // What is left in the pipes after an error would end up in the next
+    // file's hashes, so they go with it.
+    const auto fail = []() {
+        thread_pipes.clear();
+        return HashResult::Error;
+    };
+    for (const AlgorithmId algorithm : algorithms) {
+        const int sock =
+            accept4(Transform(algorithm), nullptr, nullptr, SOCK_CLOEXEC);
+        if (sock < 0) return fail();
+        socks.push_back(sock);
+    }
+
+    // Each piece goes into the first pipe, and every socket but the first
+    // gets it through a pipe of its own that is filled from that one.
+    size_t chunk = kPipeSize;
+    for (size_t i = 0; i < algorithms.size(); ++i) {
+        chunk = std::min<size_t>(chunk, ThreadPipe(i).size);
+    }
+    const Pipe& in = ThreadPipe(0);
+    loff_t offset = 0;
+    while (true) {
+        const size_t reserved = throttle->Read(offset, chunk);
+        const ssize_t amount =
+            splice(fd, &offset, in.wfd(), nullptr, chunk, SPLICE_F_MOVE);
+        throttle->Settle(reserved, amount);
+        if (amount < 0 && errno == EINTR) continue;
+        // Not every file system can splice, which shows at once.
+        if (amount < 0 && errno == EINVAL && offset == 0) {
+            return HashResult::OK;
+        }
+        if (amount < 0) return fail();
+        if (amount == 0) break;
+
+        for (size_t i = 1; i < algorithms.size(); ++i) {
+            if (!CopyAll(in, ThreadPipe(i), socks[i], fd, offset - amount,
+                         amount)) {
+                return fail();
+            }
+        }
+        if (!SpliceAll(in.rfd(), socks[0], amount)) return fail();
+        GlobalCounters()->bytes_hashed.fetch_add(amount,
+                                                 std::memory_order_relaxed);
+        cache->Read(offset - amount, amount);
+    }
+
+    DigestList ret;
+    for (size_t i = 0; i < algorithms.size(); ++i) {
+        // Sending nothing without MSG_MORE finishes the hash.
+        if (send(socks[i], nullptr, 0, 0) < 0) return fail();
+        Digest digest = {.algorithm = algorithms[i]};
+        const size_t size = GetAlgorithm(algorithms[i]).size;
+        if (read(socks[i], digest.bytes.data(), size) !=
+            static_cast<ssize_t>(size)) {
+            return fail();
+        }
+        digest.size = size;
+        ret.push_back(digest);
+    }
+    *digests = ret;
+    return HashResult::OK;
+}
+
+#else
+
+bool KernelCanHash(std::span<const AlgorithmId> algorithms) { return false; }
+
+HashResult KernelHash(int fd, std::span<const AlgorithmId> algorithms,
+                      ReadThrottle* throttle, CacheAdvice* cache,
+                      std::optional<DigestList>* digests) {
+    digests->reset();
+    return HashResult::OK;
+}
+
+#endif
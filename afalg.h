@@ -0,0 +1,41 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <optional>
+#include <span>
+
+#include "cache.h"
+#include "digest.h"
+#include "file.h"
+#include "throttle.h"
+
+// Hashing in the kernel, through the Linux crypto API's AF_ALG sockets. The
+// file's pages are spliced into the sockets, so its contents are never
+// copied to user space; only the digests are.
+
+// Returns whether the kernel can compute every one of algorithms. Always
+// false where there is no AF_ALG.
+bool KernelCanHash(std::span<const AlgorithmId> algorithms);
+
+// Hashes fd from offset 0 to its end with each of algorithms in the kernel
+// into *digests, taking from throttle and telling cache as it goes. Leaves
+// *digests empty, without reading anything, unless KernelCanHash(algorithms)
+// and fd can be spliced from. Returns HashResult::Error, with *digests
+// empty, if reading or hashing fails part way.
+HashResult KernelHash(int fd, std::span<const AlgorithmId> algorithms,
+                      ReadThrottle* throttle, CacheAdvice* cache,
+                      std::optional<DigestList>* digests);
@@ -0,0 +1,321 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "bench.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "digest.h"
+#include "file.h"
+#include "hex.h"
+#include "profile.h"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// Returns nanoseconds per call of fn, over enough calls to take a while.
+template <typename Fn>
+double TimePerCall(size_t calls, const Fn& fn) {
+    const auto start = Clock::now();
+    for (size_t i = 0; i < calls; ++i) fn(i);
+    const std::chrono::duration<double, std::nano> took = Clock::now() - start;
+    return took.count() / calls;
+}
+
+// Returns how many bytes a second md hashes, when each is len bytes long and
+// hashed on its own.
+double DigestRate(const EVP_MD* md, std::span<const char> buf) {
+    constexpr auto kDuration = std::chrono::milliseconds(100);
+    EVP_MD_CTX* const ctx = EVP_MD_CTX_new();
+    const Cleanup freer([ctx]() { EVP_MD_CTX_free(ctx); });
+    uint8_t out[EVP_MAX_MD_SIZE];
+
+    uint64_t bytes = 0;
+    const auto start = Clock::now();
+    auto now = start;
+    // Check the clock every so often, not for every tiny buffer.
+    const size_t batch = std::max<size_t>(1, (64 << 10) / buf.size());
+    while (now - start < kDuration) {
+        for (size_t i = 0; i < batch; ++i) {
+            EVP_DigestInit_ex(ctx, md, nullptr);
+            EVP_DigestUpdate(ctx, buf.data(), buf.size());
+            EVP_DigestFinal_ex(ctx, out, nullptr);
+        }
+        bytes += batch * buf.size();
+        now = Clock::now();
+    }
+    const std::chrono::duration<double> took = now - start;
+    return bytes / took.count();
+}
+
+// Returns how many bytes a second backend reads and hashes paths at, each
+// of which is size bytes long.
+double BackendRate(ReadBackend backend, const std::vector<std::string>& paths,
+                   size_t size, std::span<const AlgorithmId> algorithms) {
+    SetReadBackend(backend, DefaultBackendThresholds());
+    const auto start = Clock::now();
+    for (const auto& path : paths) {
+        const auto file = OpenFile::Create(path);
+        if (!file) DIE(path.c_str());
+        if (!file->HashContents(algorithms)) DIE(path.c_str());
+    }
+    const std::chrono::duration<double> took = Clock::now() - start;
+    return paths.size() * size / took.count();
+}
+
+// Reads paths into the page cache, or drops them from it.
+void SetCached(const std::vector<std::string>& paths, bool cached) {
+    std::vector<char> buf(1 << 20);
+    for (const auto& path : paths) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) DIE(path.c_str());
+        if (cached) {
+            while (read(fd, buf.data(), buf.size()) > 0) {}
+        } else {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        close(fd);
+    }
+}
+}  // namespace
+
+void BenchmarkHex() {
+    constexpr size_t kDigests = 4096;
+    constexpr size_t kCalls = 1 << 24;
+    constexpr size_t kSizes[] = {16, 20, 32, 64};
+
+    std::mt19937 rng(1);
+    std::vector<uint8_t> input(kDigests * 64);
+    for (auto& byte : input) byte = rng();
+
+    printf("HexEncode uses %.*s\n",
+           static_cast<int>(HexEncodeName().size()), HexEncodeName().data());
+    printf("%6s %12s %12s %8s\n", "bytes", "table ns", "simd ns", "speedup");
+    for (const size_t size : kSizes) {
+        // Both must agree before their speed means anything.
+        std::vector<char> want(kDigests * 128), got(kDigests * 128);
+        for (size_t i = 0; i < kDigests; ++i) {
+            HexEncodeTable(&input[i * 64], size, &want[i * 128]);
+            HexEncode(&input[i * 64], size, &got[i * 128]);
+        }
+        if (want != got) QUIT("HexEncode disagrees for %zu bytes\n", size);
+
+        char out[128];
+        const auto run = [&](auto encode) {
+            return TimePerCall(kCalls, [&](size_t i) {
+                encode(&input[(i % kDigests) * 64], size, out);
+                asm volatile("" : : "r"(out) : "memory");
+            });
+        };
+        const double table = run(&HexEncodeTable);
+        const double simd = run(&HexEncode);
+        printf("%6zu %12.2f %12.2f %7.2fx\n", size, table, simd,
+               table / simd);
+    }
+}
+
+void BenchmarkDigests() {
+    constexpr size_t kSizes[] = {64, 4 << 10, 64 << 10, 1 << 20};
+    // Which implementations to try. Before OpenSSL 3 there is no choice, and
+    // the empty query takes what there is.
+    const std::string_view kCandidates[] = {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        "provider=default",
+        "provider=fips",
+        "provider=legacy",
+#else
+        "",
+#endif
+    };
+
+    std::vector<char> buf(kSizes[std::size(kSizes) - 1]);
+    std::mt19937 rng(1);
+    for (auto& c : buf) c = rng();
+
+    printf("%-12s %-18s", "algorithm", "implementation");
+    for (const size_t size : kSizes) {
+        if (size < 1024) {
+            printf(" %9zuB", size);
+        } else {
+            printf(" %9zuK", size >> 10);
+        }
+    }
+    printf("   (MB/s)\n");
+
+    Profile profile;
+    for (const Algorithm& algorithm : kAlgorithms) {
+        double best_rate = 0;
+        std::string_view best;
+        for (const std::string_view candidate : kCandidates) {
+            const EVP_MD* const md = FetchDigest(algorithm.name, candidate);
+            if (!md) continue;
+            const std::string_view label =
+                candidate.empty() ? "(any)" : candidate;
+            printf("%-12.*s %-18.*s", static_cast<int>(algorithm.name.size()),
+                   algorithm.name.data(), static_cast<int>(label.size()),
+                   label.data());
+            double rate = 0;
+            for (const size_t size : kSizes) {
+                rate = DigestRate(md, std::span(buf).first(size));
+                printf(" %10.0f", rate / 1e6);
+            }
+            printf("\n");
+            fflush(stdout);
+            // Files big enough to matter are hashed in large reads, so pick
+            // by the rate for the largest buffer.
+            if (rate > best_rate * 1.02) {
+                best_rate = rate;
+                best = candidate;
+            }
+        }
+        if (best_rate > 0) profile[std::string(algorithm.name)] = best;
+    }
+
+    const std::string saved = SaveProfile(kDigestProfile, profile);
+    if (!saved.empty()) printf("Saved choices to %s\n", saved.c_str());
+}
+
+void BenchmarkBackends(const char* dir) {
+    constexpr size_t kSizes[] = {
+        4 << 10, 64 << 10, 256 << 10, 1 << 20, 4 << 20, 16 << 20, 128 << 20,
+    };
+    // Enough files of each size for this much data, within limits.
+    constexpr size_t kBytesPerSize = 128 << 20;
+    constexpr size_t kMaxFiles = 2048;
+    constexpr ReadBackend kBackends[] = {
+        ReadBackend::READ, ReadBackend::MMAP, ReadBackend::DIRECT,
+        ReadBackend::PARALLEL,
+    };
+    // A backend has to beat plain reads by this much to be worth it.
+    constexpr double kMargin = 1.05;
+
+    // The cheapest common digest, so that reading shows through.
+    AlgorithmList algorithms;
+    algorithms.push_back(*FindAlgorithm("sha1"));
+    ResolveAlgorithms(algorithms);
+
+    std::string tmp = std::string(dir) + "/hasher-bench.XXXXXX";
+    if (!mkdtemp(tmp.data())) DIE("mkdtemp");
+    std::vector<std::string> all_paths;
+    const Cleanup remover([&]() {
+        for (const auto& path : all_paths) unlink(path.c_str());
+        rmdir(tmp.c_str());
+    });
+
+    std::vector<char> data(1 << 20);
+    std::mt19937 rng(1);
+    for (auto& c : data) c = rng();
+
+    printf("Timing %.*s in %s\n", static_cast<int>(kAlgorithms[algorithms[0]]
+                                                       .name.size()),
+           kAlgorithms[algorithms[0]].name.data(), tmp.c_str());
+    printf("%-9s %-6s", "size", "cache");
+    for (const ReadBackend backend : kBackends) {
+        printf(" %9.*s", static_cast<int>(ReadBackendName(backend).size()),
+               ReadBackendName(backend).data());
+    }
+    printf("   (MB/s)\n");
+
+    // [size][cold][backend]
+    std::vector<std::array<std::array<double, std::size(kBackends)>, 2>>
+        rates(std::size(kSizes));
+    for (size_t s = 0; s < std::size(kSizes); ++s) {
+        const size_t size = kSizes[s];
+        const size_t count =
+            std::clamp<size_t>(kBytesPerSize / size, 1, kMaxFiles);
+        std::vector<std::string> paths;
+        for (size_t i = 0; i < count; ++i) {
+            paths.push_back(tmp + "/" + std::to_string(size) + "." +
+                            std::to_string(i));
+            all_paths.push_back(paths.back());
+            const int fd = open(paths.back().c_str(),
+                                O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) DIE(paths.back().c_str());
+            for (size_t done = 0; done < size;) {
+                const ssize_t written = write(
+                    fd, data.data(), std::min(data.size(), size - done));
+                if (written < 0) DIE("write");
+                done += written;
+            }
+            // Dirty pages can not be dropped, so the cold runs need this.
+            if (fsync(fd)) DIE("fsync");
+            close(fd);
+        }
+
+        for (const bool cold : {false, true}) {
+            printf("%-9s %-6s", (std::to_string(size >> 10) + "K").c_str(),
+                   cold ? "cold" : "warm");
+            for (size_t b = 0; b < std::size(kBackends); ++b) {
+                SetCached(paths, !cold);
+                rates[s][cold][b] =
+                    BackendRate(kBackends[b], paths, size, algorithms);
+                printf(" %9.0f", rates[s][cold][b] / 1e6);
+                fflush(stdout);
+            }
+            printf("\n");
+        }
+        for (const auto& path : paths) unlink(path.c_str());
+    }
+
+    // Map cached files in the longest run of sizes for which mapping beats
+    // reading. Setting up a mapping costs more than copying small files, and
+    // mapping huge ones whole can cost more than it saves.
+    BackendThresholds thresholds = {
+        .mmap_min = 0, .mmap_max = 0, .direct_min = 0,
+    };
+    for (size_t s = 0, run = 0; s < std::size(kSizes); ++s) {
+        if (rates[s][0][1] < rates[s][0][0] * kMargin) {
+            run = s + 1;
+            continue;
+        }
+        if (kSizes[s] / kSizes[run] >
+            thresholds.mmap_max / std::max<int64_t>(thresholds.mmap_min, 1)) {
+            thresholds.mmap_min = kSizes[run];
+            thresholds.mmap_max = kSizes[s];
+        }
+    }
+    // Read uncached files with O_DIRECT from the smallest size for which it
+    // beats reading at that size and every size above it.
+    for (size_t s = std::size(kSizes); s-- > 0;) {
+        if (rates[s][1][2] < rates[s][1][0] * kMargin) break;
+        thresholds.direct_min = kSizes[s];
+    }
+    printf("Suggested --mmap-min=%lld --mmap-max=%lld --direct-min=%lld\n",
+           static_cast<long long>(thresholds.mmap_min),
+           static_cast<long long>(thresholds.mmap_max),
+           static_cast<long long>(thresholds.direct_min));
+
+    Profile profile;
+    profile["mmap-min"] = std::to_string(thresholds.mmap_min);
+    profile["mmap-max"] = std::to_string(thresholds.mmap_max);
+    profile["direct-min"] = std::to_string(thresholds.direct_min);
+    const std::string saved = SaveProfile(kBackendProfile, profile);
+    if (!saved.empty()) printf("Saved them to %s\n", saved.c_str());
+}
@@ -0,0 +1,32 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+// Microbenchmarks, run with the --bench-* options. Each prints its results
+// to stdout.
+
+// Compares HexEncode against the lookup table it replaced, for each digest
+// size in use.
+void BenchmarkHex();
+
+// Measures each implementation OpenSSL offers of each algorithm, and saves
+// the fastest ones to the digests profile for later runs to use.
+void BenchmarkDigests();
+
+// Times each ReadBackend on files of various sizes, cached and not, written
+// to a temporary directory under dir. Saves the thresholds that the results
+// suggest to the backends profile, for ReadBackend::AUTO to use.
+void BenchmarkBackends(const char* dir);
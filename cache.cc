@@ -0,0 +1,116 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "cache.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <optional>
+#include <string_view>
+
+#include "common.h"
+#include "platform.h"
+
+namespace {
+CachePolicy policy = CachePolicy::KEEP;
+
+void DropRange(int fd, off_t offset, off_t len) {
+    if (len <= 0) return;
+    if (posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED)) return;
+    GlobalCounters()->bytes_evicted.fetch_add(len, std::memory_order_relaxed);
+}
+}
+
+std::optional<CachePolicy> ParseCachePolicy(std::string_view name) {
+    if (name == "keep") return CachePolicy::KEEP;
+    if (name == "sequential") return CachePolicy::SEQUENTIAL;
+    if (name == "drop") return CachePolicy::DROP;
+    if (name == "preserve") return CachePolicy::PRESERVE;
+    return std::nullopt;
+}
+
+void SetCachePolicy(CachePolicy p) { policy = p; }
+
+// static
+CacheAdvice CacheAdvice::ForFd(int fd) {
+    CacheAdvice ret;
+    if (policy == CachePolicy::KEEP) return ret;
+    ret.fd_ = fd;
+    ret.policy_ = policy;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (policy != CachePolicy::PRESERVE) return ret;
+
+    struct stat sb;
+    if (fstat(fd, &sb)) {
+        // Without knowing what was cached, leave everything be.
+        ret.policy_ = CachePolicy::SEQUENTIAL;
+        return ret;
+    }
+    const off_t regions = (sb.st_size + kRegionSize - 1) / kRegionSize;
+    ret.cached_.resize(regions);
+    for (off_t i = 0; i < regions; ++i) {
+        const off_t cached = cached_bytes(fd, i * kRegionSize, kRegionSize);
+        // Again, if in doubt keep it.
+        ret.cached_[i] = cached != 0;
+    }
+    return ret;
+}
+
+void CacheAdvice::Read(off_t offset, size_t len) {
+    if (policy_ == CachePolicy::KEEP || policy_ == CachePolicy::SEQUENTIAL) {
+        return;
+    }
+    read_ = std::max<off_t>(read_, offset + len);
+    const off_t end = read_ - read_ % kRegionSize;
+    if (end <= dropped_) return;
+    Drop(dropped_, end);
+    dropped_ = end;
+}
+
+void CacheAdvice::Finish() {
+    if (policy_ == CachePolicy::KEEP || policy_ == CachePolicy::SEQUENTIAL) {
+        return;
+    }
+    if (read_ > dropped_) Drop(dropped_, read_);
+    dropped_ = read_;
+}
+
+void CacheAdvice::Drop(off_t offset, off_t end) const {
+    if (policy_ == CachePolicy::DROP) {
+        DropRange(fd_, offset, end - offset);
+        return;
+    }
+
+    // Drop runs of regions that were not cached, and count what we keep.
+    off_t run = -1;
+    for (off_t pos = offset; pos < end;) {
+        const off_t region = pos / kRegionSize;
+        const off_t next = std::min((region + 1) * kRegionSize, end);
+        const bool cached = region >= cached_.size() || cached_[region];
+        if (cached) {
+            if (run >= 0) DropRange(fd_, run, pos - run);
+            run = -1;
+            GlobalCounters()->bytes_kept.fetch_add(
+                next - pos, std::memory_order_relaxed);
+        } else if (run < 0) {
+            run = pos;
+        }
+        pos = next;
+    }
+    if (run >= 0) DropRange(fd_, run, end - run);
+}
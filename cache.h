@@ -0,0 +1,76 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// What to do with the page cache while reading files.
+enum class CachePolicy : int {
+    // Leave it to the kernel.
+    KEEP = 0,
+    // Tell the kernel each file is read in order, so it reads further ahead.
+    SEQUENTIAL,
+    // Like SEQUENTIAL, and drop what has been read from the cache, so that
+    // hashing a large tree does not push out everything else.
+    DROP,
+    // Like DROP, but only drop what was not cached when the file was opened,
+    // so that files others were using stay cached.
+    PRESERVE,
+};
+
+std::optional<CachePolicy> ParseCachePolicy(std::string_view name);
+
+// Sets the policy for every file opened from then on.
+void SetCachePolicy(CachePolicy policy);
+
+// Applies the cache policy to one open file, as its contents are read in
+// order.
+class CacheAdvice {
+  public:
+    static CacheAdvice ForFd(int fd);
+
+    // Call once len bytes from offset have been read into memory, for each
+    // piece of the file in turn.
+    void Read(off_t offset, size_t len);
+    // Call once done reading, before closing the file.
+    void Finish();
+
+  private:
+    // Pages are dropped in whole regions of this size. The page cache keeps
+    // files in folios of up to 2 MiB, and the kernel only drops folios that
+    // are entirely inside the range it is given, so dropping each 1 MiB read
+    // as it is done drops nothing at all. This is also the granularity of
+    // PRESERVE's record of what was cached.
+    static constexpr off_t kRegionSize = 8 << 20;
+
+    // Drops what the policy says to from offset to end.
+    void Drop(off_t offset, off_t end) const;
+
+    int fd_ = -1;
+    CachePolicy policy_ = CachePolicy::KEEP;
+    // With PRESERVE, whether each region of the file had any of it cached
+    // when the file was opened.
+    std::vector<bool> cached_;
+    // Everything before dropped_ has been dealt with, and everything before
+    // read_ has been read.
+    off_t dropped_ = 0;
+    off_t read_ = 0;
+};
@@ -0,0 +1,271 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "calibrate.h"
+
+#include <fcntl.h>
+#include <fts.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "common.h"
+#include "device.h"
+#include "profile.h"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+// How much to read in each experiment. Enough to get past caches in the
+// device, small enough to finish in reasonable time on a slow disk.
+constexpr size_t kSampleBytes = 256 << 20;
+constexpr size_t kMaxSampleFiles = 4096;
+// Settings within this fraction of the best count as just as good; the
+// smallest of those wins, to save memory and leave room for others.
+constexpr double kGoodEnough = 0.95;
+
+constexpr size_t kBufferSizes[] = {
+    64 << 10, 128 << 10, 256 << 10, 512 << 10, 1 << 20, 2 << 20, 4 << 20,
+    8 << 20, 16 << 20,
+};
+constexpr int kThreadCounts[] = {1, 2, 4, 8, 16, 32};
+constexpr int kDepths[] = {1, 2, 4, 8, 16};
+
+struct SampleFile {
+    std::string path;
+    off_t size;
+};
+
+// Returns the key for dev in the devices profile: the disk's name, or the
+// device number for file systems that are not on a block device.
+std::string DeviceKey(dev_t dev) {
+    if (const auto info = GetDeviceInfo(dev)) return info->name;
+    return std::to_string(major(dev)) + ":" + std::to_string(minor(dev));
+}
+
+// Finds up to kSampleBytes worth of files under path on device dev.
+std::vector<SampleFile> FindSample(const char* path, dev_t dev) {
+    std::vector<SampleFile> ret;
+    char* const paths[] = {const_cast<char*>(path), nullptr};
+    FTS* const fts = fts_open(paths, FTS_PHYSICAL | FTS_XDEV, nullptr);
+    if (!fts) DIE("fts_open");
+    const Cleanup closer([fts]() { fts_close(fts); });
+
+    size_t total = 0;
+    while (total < kSampleBytes && ret.size() < kMaxSampleFiles) {
+        const FTSENT* const ent = fts_read(fts);
+        if (!ent) break;
+        if (ent->fts_info != FTS_F) continue;
+        if (ent->fts_statp->st_dev != dev) continue;
+        if (ent->fts_statp->st_size == 0) continue;
+        ret.push_back({ent->fts_path, ent->fts_statp->st_size});
+        total += ent->fts_statp->st_size;
+    }
+    return ret;
+}
+
+// Asks the kernel to forget the cached contents of files, so that the next
+// experiment reads them from the device again.
+void DropCache(const std::vector<SampleFile>& files) {
+    for (const auto& file : files) {
+        const int fd = open(file.path.c_str(), O_RDONLY);
+        if (fd < 0) continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+// Returns bytes a second, reading every file with threads threads, each
+// reading whole files buffer_size bytes at a time.
+double ReadFiles(const std::vector<SampleFile>& files, size_t buffer_size,
+                 int threads) {
+    DropCache(files);
+    std::atomic<size_t> next = 0;
+    std::atomic<uint64_t> bytes = 0;
+    const auto reader = [&]() {
+        std::vector<char> buf(buffer_size);
+        for (size_t i; (i = next.fetch_add(1)) < files.size();) {
+            const int fd = open(files[i].path.c_str(), O_RDONLY);
+            if (fd < 0) continue;
+            ssize_t amount;
+            while ((amount = read(fd, buf.data(), buf.size())) > 0) {
+                bytes.fetch_add(amount, std::memory_order_relaxed);
+            }
+            close(fd);
+        }
+    };
+
+    const auto start = Clock::now();
+    std::vector<std::thread> pool;
+    for (int i = 1; i < threads; ++i) pool.emplace_back(reader);
+    reader();
+    for (auto& thread : pool) thread.join();
+    const std::chrono::duration<double> took = Clock::now() - start;
+    return bytes.load() / took.count();
+}
+
+// Returns bytes a second, reading file with depth threads that each read
+// every depth'th buffer_size piece of it.
+double ReadOneFile(const SampleFile& file, size_t buffer_size, int depth) {
+    DropCache({file});
+    const int fd = open(file.path.c_str(), O_RDONLY);
+    if (fd < 0) return 0;
+    const Cleanup closer([fd]() { close(fd); });
+
+    std::atomic<uint64_t> bytes = 0;
+    const auto reader = [&](int index) {
+        std::vector<char> buf(buffer_size);
+        for (off_t off = index * buffer_size; off < file.size;
+             off += depth * buffer_size) {
+            const ssize_t amount = pread(fd, buf.data(), buf.size(), off);
+            if (amount <= 0) break;
+            bytes.fetch_add(amount, std::memory_order_relaxed);
+        }
+    };
+
+    const auto start = Clock::now();
+    std::vector<std::thread> pool;
+    for (int i = 1; i < depth; ++i) pool.emplace_back(reader, i);
+    reader(0);
+    for (auto& thread : pool) thread.join();
+    const std::chrono::duration<double> took = Clock::now() - start;
+    return bytes.load() / took.count();
+}
+
+// Runs measure on each of settings, logging each result, and returns the
+// smallest setting that came within kGoodEnough of the best.
+template <typename T, size_t N, typename Fn>
+T Choose(const char* what, const T (&settings)[N], const Fn& measure) {
+    std::vector<std::pair<T, double>> results;
+    double best = 0;
+    for (const T setting : settings) {
+        const double rate = measure(setting);
+        printf("  %-8s %10zu: %8.1f MB/s\n", what,
+               static_cast<size_t>(setting), rate / 1e6);
+        fflush(stdout);
+        results.emplace_back(setting, rate);
+        best = std::max(best, rate);
+    }
+    for (const auto& [setting, rate] : results) {
+        if (rate >= best * kGoodEnough) return setting;
+    }
+    return settings[0];
+}
+
+std::optional<DeviceTuning> ParseTuning(const std::string& value) {
+    DeviceTuning ret;
+    if (sscanf(value.c_str(), "buffer=%zu depth=%d threads=%d",
+               &ret.buffer_size, &ret.depth, &ret.threads) != 3) {
+        return std::nullopt;
+    }
+    if (ret.buffer_size == 0 || ret.depth <= 0 || ret.threads <= 0) {
+        return std::nullopt;
+    }
+    return ret;
+}
+
+const Profile& DeviceProfile() {
+    static const Profile* const profile =
+        new Profile(LoadProfile(kDeviceProfile));
+    return *profile;
+}
+}  // namespace
+
+bool Calibrate(const char* path) {
+    struct stat sb;
+    if (stat(path, &sb)) {
+        perror(path);
+        return false;
+    }
+    const std::string key = DeviceKey(sb.st_dev);
+    const auto files = FindSample(path, sb.st_dev);
+    size_t total = 0;
+    for (const auto& file : files) total += file.size;
+    if (files.empty()) {
+        WriteLocked(stderr, "No files to read under %s\n", path);
+        return false;
+    }
+    printf("Calibrating %s with %zu files (%.1f MB) under %s\n", key.c_str(),
+           files.size(), total / 1e6, path);
+    if (total < kSampleBytes / 4) {
+        printf("That is not much data, so the results may be noisy.\n");
+    }
+
+    DeviceTuning tuning;
+    tuning.buffer_size = Choose("buffer", kBufferSizes,
+                                [&](size_t size) {
+        return ReadFiles(files, size, 1);
+    });
+    tuning.threads = Choose("threads", kThreadCounts,
+                            [&](int threads) {
+        return ReadFiles(files, tuning.buffer_size, threads);
+    });
+    // Reading one file in parallel only means something for files several
+    // buffers long.
+    const auto largest = std::ranges::max_element(
+        files, {}, [](const SampleFile& file) { return file.size; });
+    if (largest->size >= static_cast<off_t>(4 * tuning.buffer_size)) {
+        tuning.depth = Choose("depth", kDepths, [&](int depth) {
+            return ReadOneFile(*largest, tuning.buffer_size, depth);
+        });
+    } else {
+        tuning.depth = 1;
+    }
+
+    Profile profile = LoadProfile(kDeviceProfile);
+    profile[key] = DescribeTuning(tuning);
+    printf("Chose %s for %s\n", profile[key].c_str(), key.c_str());
+    const std::string saved = SaveProfile(kDeviceProfile, profile);
+    if (saved.empty()) return false;
+    printf("Saved to %s\n", saved.c_str());
+    return true;
+}
+
+bool HaveDeviceTunings() { return !DeviceProfile().empty(); }
+
+std::optional<DeviceTuning> GetDeviceTuning(dev_t dev) {
+    if (!HaveDeviceTunings()) return std::nullopt;
+
+    static std::mutex mu;
+    static auto* const cache = new std::map<dev_t, std::optional<DeviceTuning>>;
+    const std::lock_guard<std::mutex> l(mu);
+    if (const auto it = cache->find(dev); it != cache->end()) {
+        return it->second;
+    }
+    std::optional<DeviceTuning> ret;
+    const auto it = DeviceProfile().find(DeviceKey(dev));
+    if (it != DeviceProfile().end()) ret = ParseTuning(it->second);
+    cache->emplace(dev, ret);
+    return ret;
+}
+
+std::string DescribeTuning(const DeviceTuning& tuning) {
+    return "buffer=" + std::to_string(tuning.buffer_size) +
+           " depth=" + std::to_string(tuning.depth) +
+           " threads=" + std::to_string(tuning.threads);
+}
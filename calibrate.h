@@ -0,0 +1,52 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+// What --calibrate found works best for reading from one device.
+struct DeviceTuning {
+    // Bytes to ask for in each read.
+    size_t buffer_size;
+    // Reads worth having in flight at once within one file.
+    int depth;
+    // Files worth reading at once.
+    int threads;
+};
+
+// Where --calibrate saves its results, keyed by disk name.
+inline constexpr std::string_view kDeviceProfile = "devices";
+
+// Times reads of the files under path with various buffer sizes, depths and
+// thread counts, logs what it finds to stdout, and saves the best settings
+// for the device holding path. Returns false if that was not possible.
+bool Calibrate(const char* path);
+
+// True when any device has been calibrated. When not, GetDeviceTuning always
+// returns nullopt, and callers may skip looking up devices at all.
+bool HaveDeviceTunings();
+
+// Returns the calibrated settings for files whose st_dev is dev, if its
+// device was calibrated. Lookups are cached, so this is cheap per file.
+std::optional<DeviceTuning> GetDeviceTuning(dev_t dev);
+
+// Describes tuning on one line, as it is saved in the profile.
+std::string DescribeTuning(const DeviceTuning& tuning);
@@ -15,9 +15,222 @@
 
 #include "common.h"
 
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <mutex>
+#include <unordered_set>
+#include <vector>
+
+namespace {
+constexpr size_t kOutputBufferSize = 64 << 10;
+
+RecordSink* record_sink = nullptr;
+
+// Writes all of data to stream's file descriptor, bypassing stdio. Callers
+// hold a buffer's lock and GlobalWriteLock(), so on failure this must not
+// exit(): that would run FlushAll, which takes those locks again.
+void WriteAll(FILE* stream, const char* data, size_t len) {
+    const int fd = fileno(stream);
+    while (len > 0) {
+        const ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) {
+            perror("write");
+            _exit(EXIT_FAILURE);
+        }
+        data += written;
+        len -= written;
+    }
+}
+
+class OutputBuffer {
+  public:
+    explicit OutputBuffer(FILE* stream) : stream_(stream) {}
+
+    void Append(const char* format, va_list args);
+    void AppendRaw(std::string_view data);
+    // Requires mu().
+    void Flush();
+    // Hands everything buffered to the record sink.
+    void Record(uint64_t seq, std::string_view key);
+
+    std::mutex& mu() { return mu_; }
+
+  private:
+    FILE* const stream_;
+    std::vector<char> data_;
+    size_t used_ = 0;
+
+    // Only contended when another thread flushes us at exit.
+    std::mutex mu_;
+};
+
+void OutputBuffer::Append(const char* format, va_list args) {
+    const std::lock_guard<std::mutex> l(mu_);
+    if (data_.empty()) data_.resize(kOutputBufferSize);
+
+    va_list copy;
+    va_copy(copy, args);
+    const int len = vsnprintf(&data_[used_], data_.size() - used_,
+                              format, copy);
+    va_end(copy);
+    if (len < 0) return;
+    if (used_ + len < data_.size()) {
+        used_ += len;
+        return;
+    }
+
+    // It did not fit. Make room (unless it is part of a record), and make the
+    // buffer big enough for it.
+    if (!record_sink || stream_ != stdout) Flush();
+    if (used_ + len >= data_.size()) data_.resize(used_ + len + 1);
+    vsnprintf(&data_[used_], data_.size() - used_, format, args);
+    used_ += len;
+}
+
+void OutputBuffer::AppendRaw(std::string_view data) {
+    const std::lock_guard<std::mutex> l(mu_);
+    if (data_.empty()) data_.resize(kOutputBufferSize);
+    if (used_ + data.size() > data_.size()) {
+        if (!record_sink || stream_ != stdout) Flush();
+        if (used_ + data.size() > data_.size()) {
+            data_.resize(used_ + data.size());
+        }
+    }
+    std::copy(data.begin(), data.end(), &data_[used_]);
+    used_ += data.size();
+}
+
+void OutputBuffer::Flush() {
+    // Records go to the sink, never straight out.
+    if (record_sink && stream_ == stdout) return;
+    if (used_ == 0) return;
+    {
+        const std::lock_guard<std::mutex> l(*GlobalWriteLock());
+        WriteAll(stream_, &data_[0], used_);
+    }
+    used_ = 0;
+}
+
+void OutputBuffer::Record(uint64_t seq, std::string_view key) {
+    const std::lock_guard<std::mutex> l(mu_);
+    record_sink->Add(seq, key, std::string_view(data_.data(), used_));
+    used_ = 0;
+}
+
+class ThreadOutput;
+
+std::mutex* RegistryLock() {
+    static std::mutex mu;
+    return &mu;
+}
+
+std::unordered_set<ThreadOutput*>* Registry() {
+    static auto* const registry = new std::unordered_set<ThreadOutput*>;
+    return registry;
+}
+
+void FlushAll();
+
+// The output buffers of one thread.
+class ThreadOutput {
+  public:
+    ThreadOutput();
+    ~ThreadOutput();
+
+    void Flush();
+
+    OutputBuffer out{stdout};
+    OutputBuffer err{stderr};
+};
+
+ThreadOutput::ThreadOutput() {
+    [[maybe_unused]] static const int registered = atexit(&FlushAll);
+    const std::lock_guard<std::mutex> l(*RegistryLock());
+    Registry()->insert(this);
+}
+
+ThreadOutput::~ThreadOutput() {
+    {
+        const std::lock_guard<std::mutex> l(*RegistryLock());
+        Registry()->erase(this);
+    }
+    Flush();
+}
+
+void ThreadOutput::Flush() {
+    for (auto* buffer : {&out, &err}) {
+        // Only FlushAll contends for these, and it flushes them itself. Or
+        // the lock is the exiting thread's own, taken before it died (while
+        // adding a record, say) and never to be released, so waiting would
+        // hang.
+        const std::unique_lock<std::mutex> l(buffer->mu(), std::try_to_lock);
+        if (l.owns_lock()) buffer->Flush();
+    }
+}
+
+// Threads that are still running at exit (because another one called exit)
+// do not get to destroy their buffers, so flush those here.
+void FlushAll() {
+    const std::lock_guard<std::mutex> l(*RegistryLock());
+    for (auto* output : *Registry()) output->Flush();
+}
+
+ThreadOutput& GetThreadOutput() {
+    thread_local ThreadOutput output;
+    return output;
+}
+}
 
 std::mutex* GlobalWriteLock() {
     static std::mutex mu;
     return &mu;
 }
+
+Counters* GlobalCounters() {
+    static Counters counters;
+    return &counters;
+}
+
+void FlushOutput() { GetThreadOutput().Flush(); }
+
+void WriteBuffered(FILE* stream, const char* format, ...) {
+    auto& output = GetThreadOutput();
+    auto& buffer = stream == stderr ? output.err : output.out;
+
+    va_list args;
+    va_start(args, format);
+    buffer.Append(format, args);
+    va_end(args);
+
+    if (stream == stderr) output.Flush();
+}
+
+void WriteRaw(FILE* stream, std::string_view data) {
+    auto& output = GetThreadOutput();
+    auto& buffer = stream == stderr ? output.err : output.out;
+    buffer.AppendRaw(data);
+    if (stream == stderr) output.Flush();
+}
+
+void WriteDirect(FILE* stream, std::string_view data) {
+    const std::lock_guard<std::mutex> l(*GlobalWriteLock());
+    WriteAll(stream, data.data(), data.size());
+}
+
+RecordSink::~RecordSink() = default;
+
+void SetRecordSink(RecordSink* sink) { record_sink = sink; }
+
+void BeginRecord(uint64_t seq) {
+    if (record_sink) record_sink->Begin(seq);
+}
+
+void EndRecord(uint64_t seq, std::string_view key) {
+    if (record_sink) GetThreadOutput().out.Record(seq, key);
+}
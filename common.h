@@ -15,12 +15,15 @@
 
 #pragma once
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <atomic>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <string_view>
 
 #define DIE(msg) do { perror(msg); exit(EXIT_FAILURE); } while (0)
 #define QUIT(...) do { printf(__VA_ARGS__); exit(EXIT_FAILURE); } while (0)
@@ -28,17 +31,70 @@
     char strname[snprintf(NULL, 0, __VA_ARGS__) + 1]; \
     snprintf(strname, sizeof(strname), __VA_ARGS__)
 
+// Held while writing buffered output to a stream.
 std::mutex* GlobalWriteLock();
 
+// Progress counters shared by all workers.
+struct Counters {
+    std::atomic<uint64_t> bytes_hashed;
+    std::atomic<uint64_t> files_done;
+    // Bytes --cache-policy dropped from the page cache after reading them,
+    // and bytes it left there because they were cached before.
+    std::atomic<uint64_t> bytes_evicted;
+    std::atomic<uint64_t> bytes_kept;
+};
+
+Counters* GlobalCounters();
+
+// Formats a message into the calling thread's buffer for stream (stdout or
+// stderr). The buffer is written out in one piece when it fills, when the
+// thread exits, and at exit, so messages from different threads never
+// interleave. Messages to stderr are written out right away, along with
+// whatever the thread had buffered for stdout.
 template <typename... T>
 void WriteLocked(FILE* stream, T... args);
 
+// Writes out the calling thread's buffered output.
+void FlushOutput();
+
+// Adds data to the calling thread's buffer for stream, like WriteLocked.
+void WriteRaw(FILE* stream, std::string_view data);
+
+// Writes data to stream right away, holding the global write lock.
+void WriteDirect(FILE* stream, std::string_view data);
+
+// Takes what is written to stdout about each file as one record, instead of
+// it being written out as it comes.
+class RecordSink {
+  public:
+    virtual ~RecordSink();
+
+    // Called before work on the file numbered seq starts. May block to keep
+    // workers from getting too far ahead.
+    virtual void Begin(uint64_t seq) = 0;
+    // Called with everything written about the file numbered seq, which is
+    // known by key.
+    virtual void Add(uint64_t seq, std::string_view key,
+                     std::string_view data) = 0;
+    // Called once all the workers are done, to write out what is left.
+    virtual void Finish() = 0;
+};
+
+// Installs sink for all threads. Must be called before writing any output.
+void SetRecordSink(RecordSink* sink);
+
+// Mark the start and end of the output about one file. These do nothing
+// unless a RecordSink is installed.
+void BeginRecord(uint64_t seq);
+void EndRecord(uint64_t seq, std::string_view key);
+
+void WriteBuffered(FILE* stream, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+
 // Implementation details
 template <typename... T>
 void WriteLocked(FILE* stream, T... args) {
-    auto* const mu = GlobalWriteLock();
-    const std::lock_guard<std::mutex> l(*mu);
-    fprintf(stream, std::forward<T>(args)...);
+    WriteBuffered(stream, std::forward<T>(args)...);
 }
 
 template <typename Fn>
@@ -0,0 +1,96 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "device.h"
+
+#include <algorithm>
+#include <optional>
+#include <string>
+
+#if defined(__linux__)
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "common.h"
+
+namespace {
+std::optional<long> ReadLong(const std::string& path) {
+    FILE* const f = fopen(path.c_str(), "r");
+    if (!f) return std::nullopt;
+    const Cleanup closer([f]() { fclose(f); });
+
+    long ret;
+    if (fscanf(f, "%ld", &ret) != 1) return std::nullopt;
+    return ret;
+}
+}
+
+std::optional<DeviceInfo> GetDeviceInfo(dev_t dev) {
+    LOCAL_STRING(link, "/sys/dev/block/%u:%u", major(dev), minor(dev));
+    char resolved[PATH_MAX];
+    if (!realpath(link, resolved)) return std::nullopt;
+
+    std::string sysdir(resolved);
+    if (access((sysdir + "/partition").c_str(), F_OK) == 0) {
+        sysdir.resize(sysdir.rfind('/'));
+    }
+
+    const auto rotational = ReadLong(sysdir + "/queue/rotational");
+    if (!rotational.has_value()) return std::nullopt;
+
+    unsigned disk_major = major(dev), disk_minor = minor(dev);
+    if (FILE* const f = fopen((sysdir + "/dev").c_str(), "r")) {
+        if (fscanf(f, "%u:%u", &disk_major, &disk_minor) != 2) {
+            disk_major = major(dev);
+            disk_minor = minor(dev);
+        }
+        fclose(f);
+    }
+
+    // SCSI and SATA disks report their tagged queue depth under device/.
+    // Everything else only has the block layer's request limit.
+    auto depth = ReadLong(sysdir + "/device/queue_depth");
+    if (!depth.has_value()) depth = ReadLong(sysdir + "/queue/nr_requests");
+
+    // The node is a property of the bus the controller sits on, so look for
+    // it on each parent of the device until we reach the root.
+    std::optional<long> numa_node;
+    if (realpath((sysdir + "/device").c_str(), resolved)) {
+        for (std::string dir(resolved);
+             !numa_node.has_value() && dir.size() > strlen("/sys/devices");
+             dir.resize(dir.rfind('/'))) {
+            numa_node = ReadLong(dir + "/numa_node");
+        }
+    }
+
+    return DeviceInfo{
+        .name = sysdir.substr(sysdir.rfind('/') + 1),
+        .disk = makedev(disk_major, disk_minor),
+        .rotational = *rotational != 0,
+        .queue_depth = static_cast<int>(std::max(depth.value_or(1), 1L)),
+        .numa_node = static_cast<int>(numa_node.value_or(-1)),
+    };
+}
+
+#else
+
+std::optional<DeviceInfo> GetDeviceInfo(dev_t dev) { return std::nullopt; }
+
+#endif
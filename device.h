@@ -0,0 +1,40 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <optional>
+#include <string>
+
+// What we know about the block device backing a file system.
+struct DeviceInfo {
+    // Kernel name of the whole-disk device, eg "nvme0n1" or "sda".
+    std::string name;
+    // The whole-disk device number, as in /sys/dev/block.
+    dev_t disk;
+    bool rotational;
+    // How many requests the device can have outstanding at once.
+    int queue_depth;
+    // The NUMA node the device's controller is attached to, or -1.
+    int numa_node;
+};
+
+// Looks up the block device that holds files whose st_dev is dev. Partitions
+// are resolved to the disk they are on. Returns nullopt when dev is not backed
+// by a block device (network and virtual file systems) or when the platform
+// does not expose this information.
+std::optional<DeviceInfo> GetDeviceInfo(dev_t dev);
@@ -0,0 +1,100 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "digest.h"
+
+#include <openssl/evp.h>
+#include <openssl/opensslv.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/provider.h>
+#define HAVE_PROVIDERS 1
+#endif
+
+#include <array>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "common.h"
+#include "profile.h"
+
+namespace {
+std::array<const EVP_MD*, kMaxAlgorithms> algorithm_mds;
+}
+
+const evp_md_st* FetchDigest(std::string_view name,
+                             std::string_view properties) {
+    const std::string name_str(name);
+#if HAVE_PROVIDERS
+    // Explicitly fetched implementations can be shared by every thread, and
+    // spare each EVP_DigestInit_ex the locked lookup that an implicit fetch
+    // through EVP_get_digestbyname costs.
+    constexpr std::string_view kProvider = "provider=";
+    const std::string props(properties);
+    if (properties.starts_with(kProvider)) {
+        const std::string provider(properties.substr(kProvider.size()));
+        if (!OSSL_PROVIDER_try_load(nullptr, provider.c_str(), 1)) {
+            return nullptr;
+        }
+    }
+    return EVP_MD_fetch(nullptr, name_str.c_str(),
+                        props.empty() ? nullptr : props.c_str());
+#else
+    if (!properties.empty()) return nullptr;
+    return EVP_get_digestbyname(name_str.c_str());
+#endif
+}
+
+void ResolveAlgorithms(std::span<const AlgorithmId> algorithms) {
+    const Profile profile = LoadProfile(kDigestProfile);
+    for (const AlgorithmId id : algorithms) {
+        const Algorithm& algorithm = GetAlgorithm(id);
+        const std::string name(algorithm.name);
+        const EVP_MD* md = nullptr;
+        // Fall back to the default if the profile's choice went away.
+        if (const auto it = profile.find(name); it != profile.end()) {
+            md = FetchDigest(name, it->second);
+        }
+        if (!md) md = FetchDigest(name, "");
+        if (!md) QUIT("Hash function %s is not available\n", name.c_str());
+        if (EVP_MD_size(md) != algorithm.size) {
+            QUIT("Hash function %s has an unexpected size\n", name.c_str());
+        }
+        algorithm_mds[id] = md;
+    }
+}
+
+std::optional<AlgorithmId> ParseAlgorithm(std::string_view name) {
+    if (const auto id = FindAlgorithm(name)) return id;
+    const EVP_MD* md = EVP_get_digestbyname(std::string(name).c_str());
+    if (!md) return std::nullopt;
+    for (size_t i = 0; i < kMaxAlgorithms; ++i) {
+        const EVP_MD* known =
+            EVP_get_digestbyname(std::string(kAlgorithms[i].name).c_str());
+        if (known && EVP_MD_type(known) == EVP_MD_type(md)) return i;
+    }
+    return std::nullopt;
+}
+
+const evp_md_st* AlgorithmMd(AlgorithmId id) { return algorithm_mds[id]; }
+
+const Digest* FindDigest(const DigestList& digests, AlgorithmId algorithm) {
+    for (const Digest& digest : digests) {
+        if (digest.algorithm == algorithm) return &digest;
+    }
+    return nullptr;
+}
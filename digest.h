@@ -0,0 +1,152 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <array>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <string_view>
+
+#include "platform.h"
+
+struct evp_md_st;
+
+// The largest digest of any algorithm (EVP_MAX_MD_SIZE).
+constexpr size_t kMaxDigestSize = 64;
+
+// A hash algorithm we know how to store.
+struct Algorithm {
+    // What OpenSSL and -C call it.
+    std::string_view name;
+    // The full name of the extended attribute holding its digest. Always
+    // NUL-terminated.
+    std::string_view xattr;
+    uint8_t size;
+    // What the Linux crypto API calls it, or empty if it has no such hash.
+    std::string_view kernel;
+};
+
+#define HASHER_ALGORITHM(name, size, kernel) \
+    {name, ATTR_PREFIX "hash." name, size, kernel}
+inline constexpr Algorithm kAlgorithms[] = {
+    HASHER_ALGORITHM("md5", 16, "md5"),
+    HASHER_ALGORITHM("sha1", 20, "sha1"),
+    HASHER_ALGORITHM("sha224", 28, "sha224"),
+    HASHER_ALGORITHM("sha256", 32, "sha256"),
+    HASHER_ALGORITHM("sha384", 48, "sha384"),
+    HASHER_ALGORITHM("sha512", 64, "sha512"),
+    HASHER_ALGORITHM("sha512-224", 28, ""),
+    HASHER_ALGORITHM("sha512-256", 32, ""),
+    HASHER_ALGORITHM("sha3-224", 28, "sha3-224"),
+    HASHER_ALGORITHM("sha3-256", 32, "sha3-256"),
+    HASHER_ALGORITHM("sha3-384", 48, "sha3-384"),
+    HASHER_ALGORITHM("sha3-512", 64, "sha3-512"),
+    HASHER_ALGORITHM("blake2b512", 64, "blake2b-512"),
+    HASHER_ALGORITHM("blake2s256", 32, ""),
+    HASHER_ALGORITHM("sm3", 32, "sm3"),
+    HASHER_ALGORITHM("ripemd160", 20, "rmd160"),
+};
+#undef HASHER_ALGORITHM
+
+// Each algorithm may only be used once in a run, so this is also the most
+// one run uses.
+constexpr size_t kMaxAlgorithms = std::size(kAlgorithms);
+
+// Identifies a hash algorithm: its position in kAlgorithms.
+using AlgorithmId = uint8_t;
+
+// Finds the algorithm whose name in kAlgorithms is name, ignoring case.
+constexpr std::optional<AlgorithmId> FindAlgorithm(std::string_view name) {
+    constexpr auto lower = [](char c) {
+        return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+    };
+    for (size_t i = 0; i < kMaxAlgorithms; ++i) {
+        if (std::ranges::equal(kAlgorithms[i].name, name, {}, lower, lower)) {
+            return i;
+        }
+    }
+    return std::nullopt;
+}
+
+// Like FindAlgorithm(), but also accepts any other name OpenSSL knows the
+// algorithm by, such as "SHA2-256" or "sha-256" for sha256.
+std::optional<AlgorithmId> ParseAlgorithm(std::string_view name);
+
+constexpr const Algorithm& GetAlgorithm(AlgorithmId id) {
+    return kAlgorithms[id];
+}
+
+constexpr std::string_view AlgorithmName(AlgorithmId id) {
+    return kAlgorithms[id].name;
+}
+
+// Where --bench-digests records the fastest implementation of each
+// algorithm, as an OpenSSL property query.
+inline constexpr std::string_view kDigestProfile = "digests";
+
+// Returns OpenSSL's implementation of name that matches properties (such as
+// "provider=default"), loading the provider named there if need be. Returns
+// null if there is none. What it returns is never freed.
+const evp_md_st* FetchDigest(std::string_view name,
+                             std::string_view properties);
+
+// Fetches the implementation of each of algorithms once, using the one in
+// the digests profile where there is one, and quits if one is missing. Must
+// be called before starting any workers.
+void ResolveAlgorithms(std::span<const AlgorithmId> algorithms);
+// The implementation found by ResolveAlgorithms().
+const evp_md_st* AlgorithmMd(AlgorithmId id);
+
+// A list of at most N things, held inline.
+template <typename T, size_t N>
+class FixedList {
+  public:
+    void push_back(const T& value) { items_[size_++] = value; }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const T& operator[](size_t i) const { return items_[i]; }
+    const T* begin() const { return items_.data(); }
+    const T* end() const { return items_.data() + size_; }
+
+  private:
+    std::array<T, N> items_;
+    size_t size_ = 0;
+};
+
+// A digest made by one algorithm, held inline.
+struct Digest {
+    AlgorithmId algorithm = 0;
+    uint8_t size = 0;
+    std::array<uint8_t, kMaxDigestSize> bytes = {};
+
+    std::span<const uint8_t> view() const { return {bytes.data(), size}; }
+    bool operator==(const Digest& other) const {
+        return algorithm == other.algorithm &&
+               std::ranges::equal(view(), other.view());
+    }
+};
+
+using AlgorithmList = FixedList<AlgorithmId, kMaxAlgorithms>;
+using DigestList = FixedList<Digest, kMaxAlgorithms>;
+
+// Returns the digest made by algorithm, or null if there is none.
+const Digest* FindDigest(const DigestList& digests, AlgorithmId algorithm);
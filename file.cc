@@ -15,232 +15,757 @@
 
 #include "file.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <openssl/evp.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <utility>
 #include <vector>
 
-#include "platform.h"
+#include "afalg.h"
+#include "cache.h"
+#include "calibrate.h"
 #include "common.h"
+#include "device.h"
+#include "platform.h"
+#include "profile.h"
+#include "throttle.h"
 
 namespace {
-std::optional<std::string_view> load_file(std::string_view path) {
-    const std::string str(path);
-    const int fd = open(str.c_str(), open_flags(str.c_str()));
+static_assert(EVP_MAX_MD_SIZE <= kMaxDigestSize);
+
+// Returns a context for algorithm, ready to hash a new file. Each thread
+// keeps one per algorithm and reuses it from file to file.
+EVP_MD_CTX* ThreadHasher(AlgorithmId algorithm) {
+    struct Contexts {
+        ~Contexts() {
+            for (auto* ctx : ctxs) EVP_MD_CTX_free(ctx);
+        }
+        std::array<EVP_MD_CTX*, kMaxAlgorithms> ctxs = {};
+    };
+    thread_local Contexts contexts;
+
+    EVP_MD_CTX*& ctx = contexts.ctxs[algorithm];
+    if (!ctx) ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, AlgorithmMd(algorithm), nullptr);
+    return ctx;
+}
 
-    if (fd < 0) return std::nullopt;
+Digest FinishDigest(EVP_MD_CTX* ctx, AlgorithmId algorithm) {
+    Digest ret = {.algorithm = algorithm};
+    unsigned md_len;
+    EVP_DigestFinal_ex(ctx, ret.bytes.data(), &md_len);
+    ret.size = md_len;
+    return ret;
+}
 
-    const Cleanup closer([fd]() { close(fd); });
+// How much to read at a time from disks that have not been calibrated.
+constexpr size_t kDefaultReadSize = 4 << 20;
+// How much each of the reads in flight reads, when nothing says otherwise.
+constexpr size_t kDefaultParallelChunk = 1 << 20;
+// The most of a file --backend=mmap maps at once.
+constexpr off_t kMmapWindow = 256 << 20;
+// How many reads --backend=parallel keeps in flight, when nothing says.
+constexpr int kDefaultParallelDepth = 4;
+// The most buffer each file read in parallel gets, however deep and big its
+// reads; deep queues of big reads get fewer of them in flight.
+constexpr size_t kMaxParallelBytes = 64 << 20;
+// The most threads the parallel reads of all workers share.
+constexpr int kMaxReadThreads = 256;
+// What O_DIRECT buffers are aligned to. Enough for any disk's logical
+// blocks, and for the page size.
+constexpr size_t kDirectAlignment = 4096;
+// Files with at most this much of them cached count as uncached; see
+// kCachedFraction for the other end.
+constexpr double kUncachedFraction = 0.1;
+
+// Measured with --bench-backends: see the commit that added it.
+constexpr BackendThresholds kDefaultThresholds = {
+    .mmap_min = 256 << 10,
+    .mmap_max = 128 << 20,
+    .direct_min = 0,
+};
 
-    struct stat buf;
-    if (fstat(fd, &buf) < 0) return std::nullopt;
-    const size_t len = buf.st_size;
+int parallel_depth = 0;
+size_t parallel_chunk = 0;
+ReadBackend read_backend = ReadBackend::READ;
+BackendThresholds thresholds = kDefaultThresholds;
 
-    const void* const mem = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mem == MAP_FAILED) return std::nullopt;
+constexpr std::string_view kBackendNames[] = {
+    "auto", "read", "mmap", "direct", "parallel", "kernel",
+};
 
-    return std::string_view(static_cast<const char*>(mem), len);
+// Returns whether files on dev are on a block device, as opposed to NFS, a
+// FUSE file system or tmpfs, where O_DIRECT is slow or unsupported.
+bool OnBlockDevice(dev_t dev) {
+  static std::mutex mu;
+  static auto* const cache = new std::map<dev_t, bool>;
+  const std::lock_guard<std::mutex> l(mu);
+  const auto it = cache->find(dev);
+  if (it != cache->end()) return it->second;
+  const bool ret = GetDeviceInfo(dev).has_value();
+  cache->emplace(dev, ret);
+  return ret;
 }
 
-void unload_buffer(std::string_view buf) {
-    auto* const data = const_cast<char*>(buf.data());
-    munmap(data, buf.size());
+// Returns the first size bytes of the calling thread's read buffer. Keeping
+// one per thread instead of one per file saves allocating it over and over,
+// and means a thread pinned to a NUMA node touches it first, and so gets it
+// from node-local memory. It only grows, to the largest size asked for.
+std::span<char> ThreadReadBuffer(size_t size) {
+  thread_local std::vector<char> buf;
+  if (buf.size() < size) buf.resize(size);
+  return std::span(buf).first(size);
 }
 
-class MappedFileImpl final : public MappedFile {
-  public:
-    explicit MappedFileImpl(std::string_view contents);
+// How to read one file.
+struct ReadPlan {
+  ReadBackend backend = ReadBackend::READ;
+  size_t chunk_size = kDefaultReadSize;
+  // How many reads PARALLEL keeps in flight.
+  int depth = 1;
+  off_t size = 0;
+};
+
+// Returns whether fd has at least fraction of its size bytes cached, going
+// by kCacheSampleBytes at each end. Errors count as neither cached nor
+// uncached.
+bool CachedAtLeast(int fd, off_t size, double fraction) {
+  const double cached = cached_fraction(fd, size, kCacheSampleBytes);
+  return cached >= 0 && cached >= fraction;
+}
+
+bool CachedAtMost(int fd, off_t size, double fraction) {
+  const double cached = cached_fraction(fd, size, kCacheSampleBytes);
+  return cached >= 0 && cached <= fraction;
+}
+
+// Returns how to read fd, from SetReadBackend, SetParallelReads and what
+// --calibrate found best for its disk.
+ReadPlan PlanReads(int fd) {
+  ReadPlan ret;
+  // Plain reads of uncalibrated disks need nothing more, unless asked to
+  // keep reads in flight.
+  if (read_backend == ReadBackend::READ && parallel_depth <= 1 &&
+      !HaveDeviceTunings()) {
+    return ret;
+  }
+  struct stat sb;
+  if (fstat(fd, &sb)) return ret;
+  ret.size = sb.st_size;
+  const auto tuning = GetDeviceTuning(sb.st_dev);
+  if (tuning) ret.chunk_size = tuning->buffer_size;
+
+  const int depth = parallel_depth ? parallel_depth
+                                   : tuning ? tuning->depth : 1;
+  const size_t chunk = parallel_chunk ? parallel_chunk
+                                      : tuning ? tuning->buffer_size
+                                               : kDefaultParallelChunk;
+  const bool deep = depth > 1 && sb.st_size >= static_cast<off_t>(2 * chunk);
+  const auto parallel = [&]() {
+    ret.backend = ReadBackend::PARALLEL;
+    ret.chunk_size = chunk;
+    ret.depth = std::min<size_t>(depth > 1 ? depth : kDefaultParallelDepth,
+                                 std::max<size_t>(kMaxParallelBytes / chunk,
+                                                  1));
+    return ret;
+  };
+
+  switch (read_backend) {
+    case ReadBackend::AUTO:
+      break;
+    case ReadBackend::PARALLEL:
+      return parallel();
+    case ReadBackend::READ:
+      // Depth from --read-depth or --calibrate is worth more than the
+      // single read() at a time that READ would do.
+      if (deep) return parallel();
+      return ret;
+    default:
+      ret.backend = read_backend;
+      return ret;
+  }
+
+  if (sb.st_size > 0 && sb.st_size >= thresholds.mmap_min &&
+      sb.st_size <= thresholds.mmap_max &&
+      CachedAtLeast(fd, sb.st_size, kCachedFraction)) {
+    ret.backend = ReadBackend::MMAP;
+    return ret;
+  }
+  if (deep) return parallel();
+  if (thresholds.direct_min > 0 && sb.st_size >= thresholds.direct_min &&
+      OnBlockDevice(sb.st_dev) &&
+      CachedAtMost(fd, sb.st_size, kUncachedFraction)) {
+    ret.backend = ReadBackend::DIRECT;
+  }
+  return ret;
+}
 
-    ~MappedFileImpl() override;
-    std::vector<uint8_t> HashContents(std::string_view hash_name) override;
+// Reads into ThreadReadBuffer(), so each thread may only be reading one of
+// these at a time. With kernel, hashes in the kernel instead where it can.
+class FdChunkSource final : public ChunkSource {
+ public:
+  FdChunkSource(int fd, size_t read_size, ReadThrottle throttle,
+                CacheAdvice cache, bool kernel = false);
+  ~FdChunkSource() override;
+  std::span<const char> Next() override;
+  HashResult Hash(std::span<const AlgorithmId> algorithms,
+                  std::optional<DigestList>* digests) override;
 
-  private:
-    const std::string_view contents_;
+ private:
+  const int fd_;
+  const size_t read_size_;
+  const bool kernel_;
+  ReadThrottle throttle_;
+  CacheAdvice cache_;
+  off_t offset_ = 0;
 };
 
-MappedFileImpl::MappedFileImpl(std::string_view contents)
-    : contents_(contents) {}
+FdChunkSource::FdChunkSource(int fd, size_t read_size, ReadThrottle throttle,
+                             CacheAdvice cache, bool kernel)
+    : fd_(fd),
+      read_size_(read_size),
+      kernel_(kernel),
+      throttle_(throttle),
+      cache_(std::move(cache)) {}
+FdChunkSource::~FdChunkSource() {
+  cache_.Finish();
+  close(fd_);
+}
 
-MappedFileImpl::~MappedFileImpl() { unload_buffer(contents_); }
+std::span<const char> FdChunkSource::Next() {
+  const std::span<char> buf = ThreadReadBuffer(read_size_);
+  const size_t reserved = throttle_.Read(offset_, buf.size());
+  const ssize_t amount = read(fd_, buf.data(), buf.size());
+  if (amount < 0) DIE("read");
+  throttle_.Settle(reserved, amount);
+  cache_.Read(offset_, amount);
+  offset_ += amount;
+  return buf.first(amount);
+}
 
-std::vector<uint8_t> MappedFileImpl::HashContents(std::string_view hash_name) {
-    auto* const md = EVP_get_digestbyname(std::string(hash_name).c_str());
-    if (!md) QUIT("hash type not found");
+HashResult FdChunkSource::Hash(std::span<const AlgorithmId> algorithms,
+                               std::optional<DigestList>* digests) {
+  if (!kernel_ || offset_ != 0) return ChunkSource::Hash(algorithms, digests);
+  return KernelHash(fd_, algorithms, &throttle_, &cache_, digests);
+}
+
+// Threads that run reads for every ParallelChunkSource. It starts empty and
+// adds a thread whenever a read is queued with none idle, up to
+// kMaxReadThreads, so it ends up about as big as the most reads that were
+// ever in flight at once.
+class ReadPool {
+ public:
+  static ReadPool* Get();
 
-    auto* const ctx = EVP_MD_CTX_new();
-    const Cleanup ctx_freer([ctx]() { EVP_MD_CTX_free(ctx); });
-    EVP_DigestInit_ex(ctx, md, nullptr);
-    EVP_DigestUpdate(ctx, contents_.data(), contents_.size());
+  void Submit(std::function<void()> task);
 
-    std::vector<uint8_t> buf(EVP_MAX_MD_SIZE);
-    unsigned md_len;
-    EVP_DigestFinal_ex(ctx, buf.data(), &md_len);
+ private:
+  void Run();
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::deque<std::function<void()>> tasks_;
+  int threads_ = 0;
+  int idle_ = 0;
+};
 
-    buf.resize(md_len);
-    return buf;
+// static
+ReadPool* ReadPool::Get() {
+  // Never destroyed, so threads still running at exit have a pool to use.
+  static auto* const pool = new ReadPool;
+  return pool;
 }
 
-class FileImpl final : public File {
-  public:
-    explicit FileImpl(std::string_view path);
+void ReadPool::Submit(std::function<void()> task) {
+  const std::lock_guard<std::mutex> l(mu_);
+  tasks_.push_back(std::move(task));
+  if (idle_ > 0) {
+    cv_.notify_one();
+  } else if (threads_ < kMaxReadThreads) {
+    ++threads_;
+    std::thread([this]() { Run(); }).detach();
+  }
+}
 
-    ~FileImpl() override;
+void ReadPool::Run() {
+  std::unique_lock<std::mutex> l(mu_);
+  while (true) {
+    ++idle_;
+    cv_.wait(l, [this]() { return !tasks_.empty(); });
+    --idle_;
+    std::function<void()> task = std::move(tasks_.front());
+    tasks_.pop_front();
+    l.unlock();
+    task();
+    l.lock();
+  }
+}
 
-    bool is_accessible(bool write) override;
+// Keeps depth preads of chunk_size bytes in flight on the ReadPool, and hands
+// their results out in order. Buffers belong to the source, so unlike
+// FdChunkSource, any thread may read any number of these at once.
+class ParallelChunkSource final : public ChunkSource {
+ public:
+  ParallelChunkSource(int fd, const ReadPlan& plan, ReadThrottle throttle,
+                      CacheAdvice cache);
+  ~ParallelChunkSource() override;
+  std::span<const char> Next() override;
 
-    std::optional<std::vector<uint8_t>> GetHashMetadata(
-        std::string_view hash_name) override;
-    HashResult SetHashMetadata(std::string_view hash_name,
-                               const std::vector<uint8_t>& value) override;
-    HashResult RemoveHashMetadata(std::string_view hash_name) override;
-    std::unique_ptr<MappedFile> Load() override;
-    std::unique_ptr<OpenFile> Open() override;
+ private:
+  struct Slot {
+    std::unique_ptr<char[]> data;
+    off_t offset = 0;
+    ssize_t amount = 0;
+    int error = 0;
+    bool done = false;
+  };
+
+  // Queues a read of the next chunk into slot. Requires mu_.
+  void Submit(Slot* slot);
+  // Submits reads into free slots until depth are in flight. Requires mu_.
+  void Fill();
 
-  private:
-    const std::string path_;
+  const int fd_;
+  const size_t chunk_size_;
+  const off_t size_;
+  ReadThrottle throttle_;
+  CacheAdvice cache_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  std::vector<Slot> slots_;
+  // The slot whose chunk Next returns next, and how many after it (in ring
+  // order) have reads queued or done.
+  size_t head_ = 0;
+  size_t in_flight_ = 0;
+  // Reads the pool has not finished yet; the destructor waits for these.
+  int outstanding_ = 0;
+  off_t next_offset_ = 0;
+  // Whether the head slot was handed out by the last call to Next.
+  bool returned_ = false;
+  bool eof_ = false;
 };
 
-FileImpl::~FileImpl() = default;
-FileImpl::FileImpl(std::string_view path) : path_(path) {}
+ParallelChunkSource::ParallelChunkSource(int fd, const ReadPlan& plan,
+                                         ReadThrottle throttle,
+                                         CacheAdvice cache)
+    : fd_(fd),
+      chunk_size_(plan.chunk_size),
+      size_(plan.size),
+      throttle_(throttle),
+      cache_(std::move(cache)),
+      slots_(plan.depth) {
+  const std::lock_guard<std::mutex> l(mu_);
+  Fill();
+}
 
-bool FileImpl::is_accessible(bool write) {
-    const int amode = R_OK | (write ? W_OK : 0);
-    return access(path_.c_str(), amode) == 0;
+ParallelChunkSource::~ParallelChunkSource() {
+  {
+    std::unique_lock<std::mutex> l(mu_);
+    cv_.wait(l, [this]() { return outstanding_ == 0; });
+  }
+  cache_.Finish();
+  close(fd_);
 }
 
-std::optional<std::vector<uint8_t>> FileImpl::GetHashMetadata(
-        std::string_view hash_name) {
-    LOCAL_STRING(attrname, "hash.%s", std::string(hash_name).c_str());
+void ParallelChunkSource::Submit(Slot* slot) {
+  // Slots only get a buffer once used, so small files only take what they
+  // need.
+  if (!slot->data) {
+    slot->data = std::make_unique_for_overwrite<char[]>(chunk_size_);
+  }
+  slot->offset = next_offset_;
+  slot->done = false;
+  next_offset_ += chunk_size_;
+  ++in_flight_;
+  ++outstanding_;
+  ReadPool::Get()->Submit([this, slot]() {
+    // On the pool's thread, so that waiting on it does not hold up mu_.
+    const size_t reserved = throttle_.Read(slot->offset, chunk_size_);
+    // pread may stop short of the end (on FUSE or NFS, or for a signal), so
+    // only stop before the chunk is full at the end of the file.
+    ssize_t amount = 0;
+    int error = 0;
+    while (static_cast<size_t>(amount) < chunk_size_) {
+      const ssize_t got = pread(fd_, slot->data.get() + amount,
+                                chunk_size_ - amount, slot->offset + amount);
+      if (got < 0 && errno == EINTR) continue;
+      if (got < 0) {
+        error = errno;
+        amount = -1;
+        break;
+      }
+      if (got == 0) break;
+      amount += got;
+    }
+    throttle_.Settle(reserved, amount);
+    const std::lock_guard<std::mutex> l(mu_);
+    slot->amount = amount;
+    slot->error = error;
+    slot->done = true;
+    --outstanding_;
+    cv_.notify_all();
+  });
+}
 
-    std::vector<uint8_t> buf(EVP_MAX_MD_SIZE);
-    size_t size = buf.size();
-    const int attr_result = get_attr(path_.c_str(), attrname, buf.data(), &size);
-    if (attr_result < 0) DIE("getxattr");
-    if (attr_result > 0) return std::nullopt;
-    buf.resize(size);
-    return buf;
+void ParallelChunkSource::Fill() {
+  // Past the size fstat saw, only read one chunk at a time, to find out
+  // whether the file grew since.
+  while (in_flight_ < slots_.size() &&
+         (next_offset_ < size_ || in_flight_ == 0)) {
+    Submit(&slots_[(head_ + in_flight_) % slots_.size()]);
+  }
 }
 
-HashResult FileImpl::SetHashMetadata(std::string_view hash_name,
-                           const std::vector<uint8_t>& value) {
-    LOCAL_STRING(attrname, "hash.%s", std::string(hash_name).c_str());
-    const auto* const converted = reinterpret_cast<const char*>(value.data());
-    const int result = set_attr(
-            path_.c_str(), attrname, converted, value.size());
-    if (result == 0) return HashResult::OK;
-    if (result < 0) DIE("set_attr");
-    return HashResult::Error;
+std::span<const char> ParallelChunkSource::Next() {
+  std::unique_lock<std::mutex> l(mu_);
+  if (returned_) {
+    returned_ = false;
+    // In order here, unlike on the pool's threads.
+    cache_.Read(slots_[head_].offset, slots_[head_].amount);
+    head_ = (head_ + 1) % slots_.size();
+    --in_flight_;
+  }
+  if (eof_) return {};
+  Fill();
+
+  Slot& slot = slots_[head_];
+  cv_.wait(l, [&slot]() { return slot.done; });
+  if (slot.amount < 0) {
+    errno = slot.error;
+    DIE("pread");
+  }
+  // A chunk that is not full reached the end of the file, even if the file
+  // shrank and reads after it came back empty.
+  if (static_cast<size_t>(slot.amount) < chunk_size_) eof_ = true;
+  returned_ = true;
+  return std::span<const char>(slot.data.get(), slot.amount);
 }
 
-HashResult FileImpl::RemoveHashMetadata(std::string_view hash_name) {
-    LOCAL_STRING(attrname, "hash.%s", std::string(hash_name).c_str());
-    const int result = remove_attr(path_.c_str(), attrname);
-    if (result == 0) return HashResult::OK;
-    if (result > 0) return HashResult::Error;
-    DIE("remove_attr");
+// Hands out a file through a window of at most kMmapWindow bytes that slides
+// along it, so that address space and memory use stay bounded however big
+// the file is. Small files fit in one window, and for those MAP_POPULATE
+// maps every (already cached) page in one go instead of faulting on each.
+class MmapChunkSource final : public ChunkSource {
+ public:
+  // Maps the window of fd, a size byte file, that starts at offset. Returns
+  // an empty span if it can not.
+  static std::span<const char> Map(int fd, off_t offset, off_t size);
+
+  // first is the Map of the window at offset 0.
+  MmapChunkSource(int fd, off_t size, std::span<const char> first,
+                  ReadThrottle throttle, CacheAdvice cache);
+  ~MmapChunkSource() override;
+  std::span<const char> Next() override;
+
+ private:
+  const int fd_;
+  const off_t size_;
+  ReadThrottle throttle_;
+  CacheAdvice cache_;
+  // What is mapped now, and where in the file it starts.
+  std::span<const char> window_;
+  off_t offset_ = 0;
+  // Whether Next has handed out window_ yet.
+  bool handed_out_ = false;
+};
+
+// static
+std::span<const char> MmapChunkSource::Map(int fd, off_t offset, off_t size) {
+  if (offset >= size) return {};
+  const size_t len = std::min<off_t>(size - offset, kMmapWindow);
+  const bool whole = offset == 0 && static_cast<off_t>(len) == size;
+  int flags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+  if (whole) flags |= MAP_POPULATE;
+#endif
+  void* const mem = mmap(nullptr, len, PROT_READ, flags, fd, offset);
+  if (mem == MAP_FAILED) return {};
+  if (!whole) {
+    madvise(mem, len, MADV_SEQUENTIAL);
+#if defined(MADV_HUGEPAGE)
+    // Only takes where the file system supports huge pages in the cache.
+    madvise(mem, len, MADV_HUGEPAGE);
+#endif
+    // Start reading the next window while this one is hashed.
+    if (offset + static_cast<off_t>(len) < size) {
+      posix_fadvise(fd, offset + len, kMmapWindow, POSIX_FADV_WILLNEED);
+    }
+  }
+  return std::span(static_cast<const char*>(mem), len);
 }
 
-std::unique_ptr<MappedFile> FileImpl::Load() {
-    if (!this->is_accessible(false)) return nullptr;
-    return MappedFile::Create(path_);
+MmapChunkSource::MmapChunkSource(int fd, off_t size,
+                                 std::span<const char> first,
+                                 ReadThrottle throttle, CacheAdvice cache)
+    : fd_(fd),
+      size_(size),
+      throttle_(throttle),
+      cache_(std::move(cache)),
+      window_(first) {}
+
+MmapChunkSource::~MmapChunkSource() {
+  if (!window_.empty()) {
+    munmap(const_cast<char*>(window_.data()), window_.size());
+  }
+  // Only once nothing maps them can the pages be dropped.
+  cache_.Finish();
+  close(fd_);
 }
 
-std::unique_ptr<OpenFile> FileImpl::Open() {
-    if (!this->is_accessible(false)) return nullptr;
-    return OpenFile::Create(path_);
+std::span<const char> MmapChunkSource::Next() {
+  if (handed_out_) {
+    // Done with the last window, so unmap it before mapping the next.
+    munmap(const_cast<char*>(window_.data()), window_.size());
+    cache_.Read(offset_, window_.size());
+    offset_ += window_.size();
+    window_ = Map(fd_, offset_, size_);
+    if (window_.empty()) {
+      if (offset_ < size_) DIE("mmap");
+      return {};
+    }
+  }
+  handed_out_ = true;
+  throttle_.Read(offset_, window_.size());
+  return window_;
 }
 
-class OpenFileImpl final : public OpenFile {
+// Reads with O_DIRECT into a buffer of its own, so that big files that are
+// read once do not go through (or push anything out of) the page cache.
+class DirectChunkSource final : public ChunkSource {
  public:
-  OpenFileImpl(int fd);
-  ~OpenFileImpl() override;
-  std::unordered_map<std::string, std::vector<uint8_t>> HashContents(
-      std::span<const std::string_view> hash_names) override;
+  DirectChunkSource(int fd, size_t read_size, ReadThrottle throttle);
+  ~DirectChunkSource() override;
+  std::span<const char> Next() override;
 
  private:
-  EVP_MD_CTX* get_hasher(std::string_view hashname);
+  struct Free {
+    void operator()(char* p) const { free(p); }
+  };
 
   const int fd_;
+  const size_t read_size_;
+  const std::unique_ptr<char, Free> buf_;
+  ReadThrottle throttle_;
+  bool direct_;
+  off_t offset_ = 0;
 };
 
-OpenFileImpl::OpenFileImpl(int fd) : fd_(fd) {}
-OpenFileImpl::~OpenFileImpl() { close(fd_); }
+DirectChunkSource::DirectChunkSource(int fd, size_t read_size,
+                                     ReadThrottle throttle)
+    : fd_(fd),
+      read_size_((read_size + kDirectAlignment - 1) & ~(kDirectAlignment - 1)),
+      buf_(static_cast<char*>(aligned_alloc(kDirectAlignment, read_size_))),
+      throttle_(throttle) {
+  if (!buf_) DIE("aligned_alloc");
+  const int flags = fcntl(fd_, F_GETFL);
+  direct_ = flags >= 0 && fcntl(fd_, F_SETFL, flags | O_DIRECT) == 0;
+}
+
+DirectChunkSource::~DirectChunkSource() { close(fd_); }
 
-std::unordered_map<std::string, std::vector<uint8_t>>
-OpenFileImpl::HashContents(std::span<const std::string_view> hash_names) {
-  if (hash_names.empty()) return {};
-  std::vector<std::pair<std::string, EVP_MD_CTX*>> hashers;
-  const Cleanup ctx_freer([&hashers]() {
-    for (auto& [unused_key, ptr] : hashers) EVP_MD_CTX_free(ptr);
-  });
-  for (const auto& hash_name : hash_names) {
-    hashers.push_back({std::string(hash_name), get_hasher(hash_name)});
+std::span<const char> DirectChunkSource::Next() {
+  const size_t reserved = throttle_.Read(offset_, read_size_);
+  ssize_t amount = read(fd_, buf_.get(), read_size_);
+  if (amount < 0 && errno == EINVAL && direct_) {
+    // Some file systems only say they do not support O_DIRECT when read.
+    direct_ = false;
+    fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+    amount = read(fd_, buf_.get(), read_size_);
   }
-  std::vector<char> buf(4 << 20, '\0');
-  while (true) {
-    const ssize_t amount = read(fd_, &buf[0], buf.size());
-    if (amount < 0) DIE("read");
-    if (amount == 0) break;
+  if (amount < 0) DIE("read");
+  throttle_.Settle(reserved, amount);
+  offset_ += amount;
+  return std::span<const char>(buf_.get(), amount);
+}
+}
 
-    for (auto& [hash_name, ctx] : hashers) {
-      EVP_DigestUpdate(ctx, &buf[0], amount);
-    }
+std::optional<ReadBackend> ParseReadBackend(std::string_view name) {
+  for (size_t i = 0; i < std::size(kBackendNames); ++i) {
+    if (name == kBackendNames[i]) return static_cast<ReadBackend>(i);
   }
+  return std::nullopt;
+}
 
-  std::unordered_map<std::string, std::vector<uint8_t>> ret;
-  for (auto& [hash_name, ctx] : hashers) {
-    std::vector<uint8_t> buf(EVP_MAX_MD_SIZE);
-    unsigned md_len;
-    EVP_DigestFinal_ex(ctx, buf.data(), &md_len);
-    buf.resize(md_len);
-    ret[hash_name] = std::move(buf);
+std::string_view ReadBackendName(ReadBackend backend) {
+  return kBackendNames[static_cast<int>(backend)];
+}
+
+BackendThresholds DefaultBackendThresholds() {
+  BackendThresholds ret = kDefaultThresholds;
+  const Profile profile = LoadProfile(kBackendProfile);
+  for (auto [key, field] : {std::pair("mmap-min", &ret.mmap_min),
+                            std::pair("mmap-max", &ret.mmap_max),
+                            std::pair("direct-min", &ret.direct_min)}) {
+    const auto it = profile.find(key);
+    if (it != profile.end()) *field = strtoll(it->second.c_str(), nullptr, 10);
   }
   return ret;
 }
 
-EVP_MD_CTX* OpenFileImpl::get_hasher(std::string_view hashname) {
-  auto* const md = EVP_get_digestbyname(std::string(hashname).c_str());
-  if (!md) QUIT("hash type not found");
+void SetReadBackend(ReadBackend backend, const BackendThresholds& t) {
+  read_backend = backend;
+  thresholds = t;
+}
+
+void SetParallelReads(int depth, size_t chunk_size) {
+  parallel_depth = depth;
+  parallel_chunk = chunk_size;
+}
+
+ChunkSource::~ChunkSource() = default;
 
-  auto* const ctx = EVP_MD_CTX_new();
-  EVP_DigestInit_ex(ctx, md, nullptr);
+HashResult ChunkSource::Hash(std::span<const AlgorithmId>,
+                             std::optional<DigestList>* digests) {
+  digests->reset();
+  return HashResult::OK;
+}
+
+// static
+std::unique_ptr<OpenFile> OpenFile::Create(const std::string& path) {
+  const int fd = open(path.c_str(), open_flags(path.c_str()));
+  if (fd < 0) return nullptr;
 
-  return ctx;
+  ReadThrottle throttle = ReadThrottle::ForFd(fd);
+  throttle.Open();
+  const ReadPlan plan = PlanReads(fd);
+  CacheAdvice cache = CacheAdvice::ForFd(fd);
+  std::unique_ptr<ChunkSource> source;
+  switch (plan.backend) {
+    case ReadBackend::MMAP:
+      // Files that can not be mapped are read instead.
+      if (const auto first = MmapChunkSource::Map(fd, 0, plan.size);
+          !first.empty()) {
+        source = std::make_unique<MmapChunkSource>(fd, plan.size, first,
+                                                   throttle, std::move(cache));
+      }
+      break;
+    case ReadBackend::DIRECT:
+      source = std::make_unique<DirectChunkSource>(fd, plan.chunk_size,
+                                                   throttle);
+      break;
+    case ReadBackend::PARALLEL:
+      source = std::make_unique<ParallelChunkSource>(fd, plan, throttle,
+                                                     std::move(cache));
+      break;
+    default:
+      break;
+  }
+  if (!source) {
+    source = std::make_unique<FdChunkSource>(
+        fd, plan.chunk_size, throttle, std::move(cache),
+        plan.backend == ReadBackend::KERNEL);
+  }
+  return std::make_unique<OpenFile>(std::move(source));
 }
+
+// static
+std::unique_ptr<OpenFile> OpenFile::Create(
+    std::unique_ptr<ChunkSource> source) {
+  return std::make_unique<OpenFile>(std::move(source));
 }
 
-MappedFile::~MappedFile() = default;
+OpenFile::OpenFile(std::unique_ptr<ChunkSource> source)
+    : source_(std::move(source)) {}
 OpenFile::~OpenFile() = default;
+
+std::optional<DigestList> OpenFile::HashContents(
+    std::span<const AlgorithmId> algorithms) {
+  if (algorithms.empty()) return DigestList();
+  std::optional<DigestList> digests;
+  if (source_->Hash(algorithms, &digests) != HashResult::OK) {
+    return std::nullopt;
+  }
+  if (digests) return digests;
+  FixedList<EVP_MD_CTX*, kMaxAlgorithms> hashers;
+  for (const AlgorithmId algorithm : algorithms) {
+    hashers.push_back(ThreadHasher(algorithm));
+  }
+  while (true) {
+    const std::span<const char> chunk = source_->Next();
+    if (chunk.empty()) break;
+    GlobalCounters()->bytes_hashed.fetch_add(chunk.size(),
+                                             std::memory_order_relaxed);
+
+    for (EVP_MD_CTX* ctx : hashers) {
+      EVP_DigestUpdate(ctx, chunk.data(), chunk.size());
+    }
+  }
+
+  DigestList ret;
+  for (size_t i = 0; i < algorithms.size(); ++i) {
+    ret.push_back(FinishDigest(hashers[i], algorithms[i]));
+  }
+  return ret;
+}
+
+File::File(const std::string& path) : path_(path), preopened_(false) {}
+File::File(const std::string& path, std::unique_ptr<OpenFile> opened)
+    : path_(path), preopened_(true), opened_(std::move(opened)) {}
 File::~File() = default;
 
-// static
-std::unique_ptr<MappedFile> MappedFile::Create(std::string_view path) {
-    auto maybe_mapped = load_file(path);
-    if (!maybe_mapped.has_value()) {
-        return std::make_unique<MappedFileImpl>(std::string_view());
+bool File::is_accessible(bool write) {
+    const int amode = R_OK | (write ? W_OK : 0);
+    return access(path_.c_str(), amode) == 0;
+}
+
+int64_t File::size() {
+    if (!size_) {
+        struct stat sb;
+        size_ = stat(path_.c_str(), &sb) ? -1 : sb.st_size;
     }
-    return std::make_unique<MappedFileImpl>(std::move(maybe_mapped).value());
+    return *size_;
 }
 
-// static
-std::unique_ptr<OpenFile> OpenFile::Create(std::string_view path) {
-  const int oflags = open_flags(std::string(path).c_str());
-  const int fd = open(std::string(path).c_str(), oflags);
-  if (fd < 0) return nullptr;
+std::optional<Digest> File::GetHashMetadata(AlgorithmId algorithm) {
+    Digest ret = {.algorithm = algorithm};
+    size_t size = ret.bytes.size();
+    const int attr_result = get_attr(path_.c_str(),
+                                     GetAlgorithm(algorithm).xattr.data(),
+                                     ret.bytes.data(), &size);
+    if (attr_result < 0) DIE("getxattr");
+    if (attr_result > 0) return std::nullopt;
+    ret.size = size;
+    return ret;
+}
+
+HashResult File::SetHashMetadata(const Digest& digest) {
+    const int result = set_attr(path_.c_str(),
+                                GetAlgorithm(digest.algorithm).xattr.data(),
+                                digest.bytes.data(), digest.size);
+    if (result == 0) return HashResult::OK;
+    if (result < 0) DIE("set_attr");
+    return HashResult::Error;
+}
 
-  return std::make_unique<OpenFileImpl>(fd);
+HashResult File::RemoveHashMetadata(AlgorithmId algorithm) {
+    const int result = remove_attr(path_.c_str(),
+                                   GetAlgorithm(algorithm).xattr.data());
+    if (result == 0) return HashResult::OK;
+    if (result > 0) return HashResult::Error;
+    DIE("remove_attr");
 }
 
-// static
-std::unique_ptr<File> File::Create(std::string_view path) {
-    return std::make_unique<FileImpl>(path);
+std::unique_ptr<OpenFile> File::Open() {
+    if (!this->is_accessible(false)) return nullptr;
+    if (preopened_) return std::move(opened_);
+    return OpenFile::Create(path_);
 }
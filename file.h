@@ -21,46 +21,129 @@
 #include <memory>
 #include <optional>
 #include <span>
+#include <string>
 #include <string_view>
-#include <unordered_map>
 #include <variant>
-#include <vector>
+
+#include "digest.h"
 
 enum class HashResult : int {
     OK = 0,
     Error,
 };
 
-class MappedFile {
- public: 
-  static std::unique_ptr<MappedFile> Create(std::string_view path);
+// How OpenFile::Create gets at the contents of files. READ unless
+// SetReadBackend says otherwise.
+enum class ReadBackend : int {
+  // Choose for each file from its size, what of it is cached, and its disk.
+  AUTO = 0,
+  // read() one buffer at a time.
+  READ,
+  // Map the file, a window at a time. A file that shrinks while mapped
+  // kills the process with SIGBUS.
+  MMAP,
+  // read() with O_DIRECT, bypassing the page cache.
+  DIRECT,
+  // Several preads in flight at once (see SetParallelReads).
+  PARALLEL,
+  // Splice the file into the kernel's own hashes (see afalg.h), where it has
+  // every algorithm asked for, and read() it otherwise. Only when asked for.
+  KERNEL,
+};
+
+std::optional<ReadBackend> ParseReadBackend(std::string_view name);
+std::string_view ReadBackendName(ReadBackend backend);
 
-  virtual ~MappedFile();
-  virtual std::vector<uint8_t> HashContents(std::string_view hash_name) = 0;
+// Where ReadBackend::AUTO switches backends.
+struct BackendThresholds {
+  // Files in the page cache from mmap_min to mmap_max bytes long are mapped.
+  // Zero for mmap_max never maps any.
+  int64_t mmap_min;
+  int64_t mmap_max;
+  // Files at least this big that are not in the page cache, on a block
+  // device, are read with O_DIRECT. Zero never does.
+  int64_t direct_min;
 };
 
+// Where --bench-backends saves the thresholds it suggests.
+inline constexpr std::string_view kBackendProfile = "backends";
+
+// Returns the thresholds --bench-backends saved, or else built-in ones.
+BackendThresholds DefaultBackendThresholds();
+
+// Sets how OpenFile::Create reads files from then on.
+void SetReadBackend(ReadBackend backend, const BackendThresholds& thresholds);
+
+// Sets how ReadBackend::PARALLEL reads: depth preads of chunk_size bytes in
+// flight at once, on a shared pool of threads, with the chunks hashed in
+// order. READ and AUTO use it for files of at least two chunks when depth is
+// above 1.
+// Zero for either means what --calibrate found for the file's disk, or else
+// depth 1 (4 when PARALLEL is asked for) and 1 MiB chunks. Depth is cut so
+// that a file's reads in flight take at most 64 MiB. Must be called before
+// any file is opened.
+void SetParallelReads(int depth, size_t chunk_size);
+
+// Produces the contents of a file in order, one chunk at a time.
+class ChunkSource {
+ public:
+  virtual ~ChunkSource();
+
+  // Returns the next chunk of the file, or an empty span at the end. The
+  // chunk stays valid until the next call.
+  virtual std::span<const char> Next() = 0;
+
+  // Sets *digests to the digests of the whole file with each of algorithms,
+  // if this can compute them without Next(), or else leaves it empty.
+  // Returns HashResult::Error if reading the file failed. Called before
+  // Next().
+  virtual HashResult Hash(std::span<const AlgorithmId> algorithms,
+                          std::optional<DigestList>* digests);
+};
+
+// The contents of a file, ready to be hashed. Where they come from is up to
+// the ChunkSource, which Create(path) picks as SetReadBackend says.
 class OpenFile {
  public:
-  static std::unique_ptr<OpenFile> Create(std::string_view path);
+  static std::unique_ptr<OpenFile> Create(const std::string& path);
+  static std::unique_ptr<OpenFile> Create(std::unique_ptr<ChunkSource> source);
 
-  virtual ~OpenFile();
-  virtual std::unordered_map<std::string, std::vector<uint8_t>> HashContents(
-      std::span<const std::string_view> hash_names) = 0;
+  explicit OpenFile(std::unique_ptr<ChunkSource> source);
+  ~OpenFile();
+
+  // Returns one digest for each of algorithms, in the same order, or nullopt
+  // if the file could not be read.
+  std::optional<DigestList> HashContents(
+      std::span<const AlgorithmId> algorithms);
+
+ private:
+  const std::unique_ptr<ChunkSource> source_;
 };
 
+// A file, and the hashes stored with it. Workers make one for each file on
+// their stack, so path must outlive it.
 class File {
  public:
-  static std::unique_ptr<File> Create(std::string_view path);
-  virtual ~File();
+  explicit File(const std::string& path);
+  // Like File(path), but Open() hands out opened (which may be null if the
+  // file could not be opened) instead of opening path itself.
+  File(const std::string& path, std::unique_ptr<OpenFile> opened);
+  ~File();
+
+  std::string_view path() const { return path_; }
+  bool is_accessible(bool write);
+  // The size of the file, or -1 if it can not be found.
+  int64_t size();
 
-  virtual bool is_accessible(bool write) = 0;
+  std::optional<Digest> GetHashMetadata(AlgorithmId algorithm);
+  HashResult SetHashMetadata(const Digest& digest);
+  HashResult RemoveHashMetadata(AlgorithmId algorithm);
 
-  virtual std::optional<std::vector<uint8_t>> GetHashMetadata(
-      std::string_view hash_name) = 0;
-  virtual HashResult SetHashMetadata(
-      std::string_view hash_name, const std::vector<uint8_t>& value) = 0;
-  virtual HashResult RemoveHashMetadata(std::string_view hash_name) = 0;
+  std::unique_ptr<OpenFile> Open();
 
-  virtual std::unique_ptr<MappedFile> Load() = 0;
-  virtual std::unique_ptr<OpenFile> Open() = 0;
+ private:
+  const std::string& path_;
+  const bool preopened_;
+  std::unique_ptr<OpenFile> opened_;
+  std::optional<int64_t> size_;
 };
@@ -0,0 +1,248 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "format.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "common.h"
+#include "hex.h"
+
+namespace {
+OutputFormat output_format = OutputFormat::TEXT;
+bool output_name_hashes = false;
+
+// Each thread formats into its own buffer, which keeps its capacity from one
+// record to the next.
+std::string& Scratch() {
+    thread_local std::string scratch = []() {
+        std::string ret;
+        ret.reserve(4096);
+        return ret;
+    }();
+    scratch.clear();
+    return scratch;
+}
+
+std::string_view StatusName(RecordStatus status) {
+    switch (status) {
+        case RecordStatus::SET: return "set";
+        case RecordStatus::STORED: return "stored";
+        case RecordStatus::OK: return "ok";
+        case RecordStatus::FAILED: return "failed";
+        case RecordStatus::MISSING: return "missing";
+    }
+    QUIT("Unhandled case in %s (%u)\n", __func__,
+         static_cast<unsigned>(status));
+}
+
+void AppendHex(std::string* out, std::span<const uint8_t> bytes) {
+    const size_t start = out->size();
+    out->resize(start + bytes.size() * 2);
+    HexEncode(bytes.data(), bytes.size(), &(*out)[start]);
+}
+
+// Returns the length of the UTF-8 sequence starting at s[i], or 0 if it is
+// not a valid one.
+size_t Utf8Length(std::string_view s, size_t i) {
+    const auto c = static_cast<uint8_t>(s[i]);
+    size_t len;
+    uint32_t cp;
+    if (c < 0x80) return 1;
+    if (c >= 0xc2 && c < 0xe0) {
+        len = 2;
+        cp = c & 0x1f;
+    } else if (c >= 0xe0 && c < 0xf0) {
+        len = 3;
+        cp = c & 0x0f;
+    } else if (c >= 0xf0 && c < 0xf5) {
+        len = 4;
+        cp = c & 0x07;
+    } else {
+        return 0;
+    }
+    if (i + len > s.size()) return 0;
+    for (size_t j = 1; j < len; ++j) {
+        const auto cont = static_cast<uint8_t>(s[i + j]);
+        if ((cont & 0xc0) != 0x80) return 0;
+        cp = (cp << 6) | (cont & 0x3f);
+    }
+    // Overlong forms, surrogates and values past the last code point.
+    if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000)) return 0;
+    if ((cp >= 0xd800 && cp < 0xe000) || cp > 0x10ffff) return 0;
+    return len;
+}
+
+bool IsUtf8(std::string_view s) {
+    for (size_t i = 0; i < s.size();) {
+        const size_t len = Utf8Length(s, i);
+        if (!len) return false;
+        i += len;
+    }
+    return true;
+}
+
+// Appends s as the contents of a JSON string. s must be valid UTF-8.
+void AppendJsonString(std::string* out, std::string_view s) {
+    static constexpr char kHex[] = "0123456789abcdef";
+    for (const char ch : s) {
+        const auto c = static_cast<uint8_t>(ch);
+        switch (c) {
+            case '"': *out += "\\\""; continue;
+            case '\\': *out += "\\\\"; continue;
+            case '\n': *out += "\\n"; continue;
+            case '\r': *out += "\\r"; continue;
+            case '\t': *out += "\\t"; continue;
+        }
+        if (c < 0x20) {
+            const char escape[] = {
+                '\\', 'u', '0', '0', kHex[c >> 4], kHex[c & 0xf],
+            };
+            out->append(escape, sizeof(escape));
+            continue;
+        }
+        *out += ch;
+    }
+}
+
+void AppendNumber(std::string* out, const char* format, auto value) {
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), format, value);
+    out->append(buf, len);
+}
+
+void WriteJson(const HashRecord& r) {
+    std::string& out = Scratch();
+    if (IsUtf8(r.path)) {
+        out += "{\"path\":\"";
+        AppendJsonString(&out, r.path);
+    } else {
+        out += "{\"path_hex\":\"";
+        AppendHex(&out, std::span(
+            reinterpret_cast<const uint8_t*>(r.path.data()), r.path.size()));
+    }
+    out += "\",\"algorithm\":\"";
+    AppendJsonString(&out, r.algorithm);
+    if (r.digest.empty()) {
+        out += "\",\"digest\":null";
+    } else {
+        out += "\",\"digest\":\"";
+        AppendHex(&out, r.digest);
+        out += '"';
+    }
+    out += ",\"size\":";
+    AppendNumber(&out, "%lld", static_cast<long long>(r.size));
+    out += ",\"status\":\"";
+    out += StatusName(r.status);
+    out += "\",\"seconds\":";
+    AppendNumber(&out, "%.6f", r.nanos / 1e9);
+    out += "}\n";
+    WriteRaw(stdout, out);
+}
+
+template <typename T>
+void AppendLittleEndian(std::string* out, T value) {
+    for (size_t i = 0; i < sizeof(T); ++i) {
+        *out += static_cast<char>(static_cast<uint64_t>(value) >> (8 * i));
+    }
+}
+
+void WriteBinary(const HashRecord& r) {
+    std::string& out = Scratch();
+    const uint32_t length = 4 + 8 + 8 + 4 + r.algorithm.size() +
+                            r.digest.size() + r.path.size();
+    AppendLittleEndian<uint32_t>(&out, length);
+    AppendLittleEndian<uint8_t>(&out, static_cast<uint8_t>(r.status));
+    AppendLittleEndian<uint8_t>(&out, r.algorithm.size());
+    AppendLittleEndian<uint8_t>(&out, r.digest.size());
+    AppendLittleEndian<uint8_t>(&out, 0);
+    AppendLittleEndian<int64_t>(&out, r.size);
+    AppendLittleEndian<uint64_t>(&out, r.nanos);
+    AppendLittleEndian<uint32_t>(&out, r.path.size());
+    out += r.algorithm;
+    out.append(reinterpret_cast<const char*>(r.digest.data()),
+               r.digest.size());
+    out += r.path;
+    WriteRaw(stdout, out);
+}
+
+// Writes the same lines as "%s  %s\n" and friends would, without going
+// through printf.
+void WriteText(const HashRecord& r) {
+    constexpr size_t kNameWidth = 10;
+    std::string& out = Scratch();
+    switch (r.status) {
+        case RecordStatus::SET:
+        case RecordStatus::STORED:
+            AppendHex(&out, r.digest);
+            if (output_name_hashes) {
+                out += " [";
+                if (r.algorithm.size() < kNameWidth) {
+                    out.append(kNameWidth - r.algorithm.size(), ' ');
+                }
+                out += r.algorithm;
+                out += "] ";
+            } else {
+                out += "  ";
+            }
+            out += r.path;
+            break;
+        case RecordStatus::OK:
+        case RecordStatus::FAILED:
+            out += r.path;
+            out += ": ";
+            out += r.algorithm;
+            out += r.status == RecordStatus::OK ? " OK" : " FAILED";
+            break;
+        case RecordStatus::MISSING:
+            out += "Skipping ";
+            out += r.path;
+            out += " (missing ";
+            out += r.algorithm;
+            out += " hash)";
+            break;
+    }
+    out += '\n';
+    WriteRaw(stdout, out);
+}
+}  // namespace
+
+std::optional<OutputFormat> ParseOutputFormat(std::string_view name) {
+    if (name == "text") return OutputFormat::TEXT;
+    if (name == "jsonl") return OutputFormat::JSONL;
+    if (name == "binary") return OutputFormat::BINARY;
+    return std::nullopt;
+}
+
+void SetOutputFormat(OutputFormat format, bool name_hashes) {
+    output_format = format;
+    output_name_hashes = name_hashes;
+}
+
+OutputFormat GetOutputFormat() { return output_format; }
+
+void WriteRecord(const HashRecord& record) {
+    switch (output_format) {
+        case OutputFormat::TEXT: return WriteText(record);
+        case OutputFormat::JSONL: return WriteJson(record);
+        case OutputFormat::BINARY: return WriteBinary(record);
+    }
+}
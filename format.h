@@ -0,0 +1,73 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stdint.h>
+
+#include <optional>
+#include <span>
+#include <string_view>
+
+// How results are written to stdout.
+//
+// TEXT is the usual sha*sum style lines. JSONL writes one JSON object per
+// line:
+//
+//   {"path":"a b","algorithm":"sha256","digest":"e3b0...","size":0,
+//    "status":"ok","seconds":0.000012}
+//
+// Paths that are not valid UTF-8 are given as "path_hex" instead of "path",
+// and digest is null when there is none. BINARY writes records of
+//
+//   u32 length of the rest of the record
+//   u8  status, u8 algorithm length, u8 digest length, u8 zero
+//   i64 size, u64 nanoseconds, u32 path length
+//   algorithm, digest, path
+//
+// with all integers little-endian.
+enum class OutputFormat {
+    TEXT,
+    JSONL,
+    BINARY,
+};
+
+std::optional<OutputFormat> ParseOutputFormat(std::string_view name);
+
+// What was done with one hash of one file.
+enum class RecordStatus : uint8_t {
+    SET = 0,      // Computed and stored.
+    STORED = 1,   // Read from the file's metadata.
+    OK = 2,       // Checked, and it matched.
+    FAILED = 3,   // Checked, and it did not match.
+    MISSING = 4,  // Not in the file's metadata, so not checked.
+};
+
+struct HashRecord {
+    std::string_view path;
+    std::string_view algorithm;
+    std::span<const uint8_t> digest;  // Empty for MISSING.
+    int64_t size;  // -1 if unknown.
+    uint64_t nanos;  // Time spent reading and hashing, or 0.
+    RecordStatus status;
+};
+
+// Sets the format for all threads. With TEXT, name_hashes says whether
+// lines name the algorithm (as when hashing with more than one).
+void SetOutputFormat(OutputFormat format, bool name_hashes);
+OutputFormat GetOutputFormat();
+
+// Formats record into the calling thread's stdout buffer.
+void WriteRecord(const HashRecord& record);
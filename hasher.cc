@@ -14,24 +14,42 @@
 // Hasher. If not, see <https://www.gnu.org/licenses/>.
 
 #include <atomic>
+#include <chrono>
 #include <algorithm>
+#include <getopt.h>
 #include <iostream>
 #include <libgen.h>
+#include <map>
 #include <mutex>
 #include <numeric>
+#include <optional>
 #include <span>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <thread>
 #include <unistd.h>
 #include <vector>
 
+#include "bench.h"
+#include "cache.h"
+#include "calibrate.h"
 #include "common.h"
 #include "utils.h"
+#include "digest.h"
 #include "file.h"
+#include "format.h"
+#include "numa.h"
+#include "output.h"
+#include "pipeline.h"
 #include "platform.h"
+#include "pressure.h"
+#include "resources.h"
+#include "schedule.h"
+#include "throttle.h"
+#include "tuning.h"
 
 namespace {
 const std::vector<std::string_view> DefaultHashes() {
@@ -40,6 +58,17 @@ const std::vector<std::string_view> DefaultHashes() {
     return {kSha512, kBlake2b512};
 }
 
+// Adds the algorithm called name to algorithms, unless it is already there.
+void AddAlgorithm(AlgorithmList* algorithms, std::string_view name) {
+    const auto id = ParseAlgorithm(name);
+    if (!id) {
+        QUIT("Unsupported hash function: %.*s\n",
+             static_cast<int>(name.size()), name.data());
+    }
+    if (std::ranges::find(*algorithms, *id) != algorithms->end()) return;
+    algorithms->push_back(*id);
+}
+
 enum class HashStatus : unsigned {
     OK = 0,
     MISMATCH = (1 << 0),
@@ -61,6 +90,68 @@ int ParseInt(std::string_view arg) {
     return ret;
 }
 
+// Parses a size with an optional binary suffix, like "200M".
+uint64_t ParseSize(std::string_view arg) {
+    const std::string str(arg);
+    char* endptr = nullptr;
+    const unsigned long long ret = strtoull(str.c_str(), &endptr, 0);
+
+    int shift = 0;
+    switch (*endptr) {
+        case 'T': case 't': shift += 10; [[fallthrough]];
+        case 'G': case 'g': shift += 10; [[fallthrough]];
+        case 'M': case 'm': shift += 10; [[fallthrough]];
+        case 'K': case 'k': shift += 10; ++endptr; break;
+    }
+
+    bool good = true;
+    good &= endptr != str.c_str();
+    good &= *endptr == '\0';
+    good &= ret > 0;
+    // strtoull takes "-1" for a huge size instead of failing.
+    good &= str.find('-') == std::string::npos;
+    good &= ret <= (std::numeric_limits<uint64_t>::max() >> shift);
+    if (!good) QUIT("Invalid size: %s\n", str.c_str());
+
+    return static_cast<uint64_t>(ret) << shift;
+}
+
+// Splits "VALUE@PATH" into VALUE and the device holding PATH.
+std::pair<std::string_view, std::optional<dev_t>> SplitDevice(
+        std::string_view arg) {
+    const size_t at = arg.find('@');
+    if (at == arg.npos) return {arg, std::nullopt};
+
+    const std::string path(arg.substr(at + 1));
+    struct stat sb;
+    if (stat(path.c_str(), &sb)) QUIT("Failed to stat %s\n", path.c_str());
+    return {arg.substr(0, at), sb.st_dev};
+}
+
+// Parses a list like "io:20,cpu:60" into thresholds, starting from base.
+PressureThresholds ParsePressure(std::string_view arg,
+                                 PressureThresholds base) {
+    std::string str(arg);
+    char* save = nullptr;
+    for (char* item = strtok_r(str.data(), ",", &save); item;
+         item = strtok_r(nullptr, ",", &save)) {
+        char* const colon = strchr(item, ':');
+        if (!colon) QUIT("Invalid pressure limit: %s\n", item);
+        *colon = '\0';
+        const double value = ParseInt(colon + 1);
+        if (!strcmp(item, "io")) {
+            base.io = value;
+        } else if (!strcmp(item, "cpu")) {
+            base.cpu = value;
+        } else if (!strcmp(item, "memory")) {
+            base.memory = value;
+        } else {
+            QUIT("Unknown pressure resource: %s\n", item);
+        }
+    }
+    return base;
+}
+
 unsigned HashStatusToUnsigned(HashStatus a) {
     switch (a) {
         case HashStatus::OK: return 0;
@@ -77,24 +168,80 @@ HashStatus HashStatusMax(HashStatus a, HashStatus b) {
     return b;
 }
 
-using HashList = std::vector<std::string_view>;
+// What one of -s, -c, -p, -H or -r does to one file.
+using Mode = HashStatus (*)(File*, const AlgorithmList&);
 
-void Worker(
-        FnameIterator* iterator,
-        const HashList& hashnames,
-        const std::function<HashStatus(std::string_view,
-                                       const HashList&)>& task,
-        std::atomic<unsigned>* ret) {
+// What every worker shares.
+struct WorkerContext {
+    const AlgorithmList& algorithms;
+    WorkerGate* gate;
+    bool numa;
+    std::atomic<unsigned>* ret;
+};
+
+// Workers are specialised for their mode, so that the loop calls it
+// directly.
+template <Mode mode>
+void Worker(FnameIterator* iterator, const WorkerContext& ctx, int index) {
+    if (ctx.numa) PinToNumaNode(index);
     while (true) {
-        const std::string cur = iterator->GetNext();
-        if (cur.empty()) break;
-        *ret |= HashStatusToUnsigned(task(cur, hashnames));
+        ctx.gate->Wait(index);
+        const FnameEntry cur = iterator->GetNext();
+        if (cur.path.empty()) break;
+        BeginRecord(cur.seq);
+        File file(cur.path);
+        *ctx.ret |= HashStatusToUnsigned(mode(&file, ctx.algorithms));
+        EndRecord(cur.seq, cur.path);
+        iterator->Finished(cur);
+        GlobalCounters()->files_done.fetch_add(1, std::memory_order_relaxed);
     }
+    ctx.gate->Open();
 }
 
-HashStatus ApplyHash(std::string_view fname, const HashList& hashnames) {
-    const bool print_name = hashnames.size() > 1;
-    auto file = File::Create(fname);
+// Like Worker, but only hashes; the reading was done by the pipeline.
+template <Mode mode>
+void PipelineWorker(ReadPipeline* pipeline, const WorkerContext& ctx,
+                    int index) {
+    if (ctx.numa) PinToNumaNode(index);
+    while (true) {
+        ctx.gate->Wait(index);
+        ReadPipeline::Job job = pipeline->GetNext();
+        if (job.entry.path.empty()) break;
+        BeginRecord(job.entry.seq);
+        File file(job.entry.path, std::move(job.contents));
+        *ctx.ret |= HashStatusToUnsigned(mode(&file, ctx.algorithms));
+        EndRecord(job.entry.seq, job.entry.path);
+        GlobalCounters()->files_done.fetch_add(1, std::memory_order_relaxed);
+    }
+    ctx.gate->Open();
+}
+
+// Runs num_threads copies of worker on source, one of them on this thread.
+template <typename Source>
+void RunWorkers(void (*worker)(Source*, const WorkerContext&, int),
+                Source* source, int num_threads, const WorkerContext& ctx) {
+    std::vector<std::thread> workers;
+    workers.reserve(num_threads);
+    for (int i = 1; i < num_threads; ++i) {
+        workers.emplace_back(worker, source, std::cref(ctx), i);
+    }
+    worker(source, ctx, 0);
+    for (auto& thread : workers) thread.join();
+}
+
+// The size to report for file. Only looked up when the format shows it.
+int64_t RecordSize(File* file) {
+    if (GetOutputFormat() == OutputFormat::TEXT) return -1;
+    return file->size();
+}
+
+uint64_t NanosSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+HashStatus ApplyHash(File* file, const AlgorithmList& algorithms) {
+    const std::string_view fname = file->path();
     if (!file->is_accessible(true)) {
         WriteLocked(stderr, "Skipping %s (insufficient permissions)\n",
                 std::string(fname).c_str());
@@ -109,62 +256,68 @@ HashStatus ApplyHash(std::string_view fname, const HashList& hashnames) {
         return HashStatus::ERROR;
     }
 
-    const HashList unknowns([&]() {
-        HashList ret;
-        for (const auto& name : hashnames) {
-            if (file->GetHashMetadata(name)) {
-                WriteLocked(stderr, "Skipping %s for %s (already has hash)\n",
+    const AlgorithmList unknowns([&]() {
+        AlgorithmList ret;
+        for (const AlgorithmId algorithm : algorithms) {
+            if (file->GetHashMetadata(algorithm)) {
+                const std::string_view name = AlgorithmName(algorithm);
+                WriteLocked(stderr, "Skipping %s for %.*s (already has hash)\n",
                             std::string(fname).c_str(),
-                            std::string(name).c_str());
+                            static_cast<int>(name.size()), name.data());
                 continue;
             }
-            ret.push_back(name);
+            ret.push_back(algorithm);
         }
         return ret;
     }());
 
     if (unknowns.empty()) return ret;
 
-    const auto hashes = contents->HashContents(std::span{unknowns});
-    for (auto& [hashname, value] : hashes) {
-        if (file->SetHashMetadata(hashname, value) != HashResult::OK) {
+    const auto start = std::chrono::steady_clock::now();
+    const auto digests = contents->HashContents(unknowns);
+    const uint64_t nanos = NanosSince(start);
+    if (!digests) {
+        WriteLocked(stderr, "Skipping %s (failed to read)\n",
+                std::string(fname).c_str());
+        return HashStatus::ERROR;
+    }
+    const int64_t size = RecordSize(file);
+    for (const Digest& digest : *digests) {
+        if (file->SetHashMetadata(digest) != HashResult::OK) {
             WriteLocked(stderr, "Failed to write xattr to %s\n",
                                 std::string(fname).c_str());
             ret = HashStatusMax(ret, HashStatus::ERROR);
         }
-        if (print_name) {
-            WriteLocked(stdout, "%s [%10s] %s\n",
-                                HashToString(value).c_str(),
-                                std::string(hashname).c_str(),
-                                std::string(fname).c_str());
-        } else {
-            WriteLocked(stdout, "%s  %s\n",
-                                HashToString(value).c_str(),
-                                std::string(fname).c_str());
-        }
+        WriteRecord({
+            .path = fname,
+            .algorithm = AlgorithmName(digest.algorithm),
+            .digest = digest.view(),
+            .size = size,
+            .nanos = nanos,
+            .status = RecordStatus::SET,
+        });
     }
     return ret;
 }
 
-HashStatus HasHash(std::string_view fname, const HashList& hashnames) {
-    const bool print_name = hashnames.size() > 1;
-    auto file = File::Create(fname);
+HashStatus HasHash(File* file, const AlgorithmList& algorithms) {
+    const std::string_view fname = file->path();
 
     HashStatus ret = HashStatus::OK;
-    for (const auto hashname : hashnames) {
-        if (file->GetHashMetadata(hashname)) continue;
+    for (const AlgorithmId algorithm : algorithms) {
+        if (file->GetHashMetadata(algorithm)) continue;
         ret = HashStatusMax(ret, HashStatus::MISMATCH);
     }
 
     if (ret == HashStatus::MISMATCH) {
-        WriteLocked(stdout, "%s\n", std::string(fname).c_str());
+        WriteLocked(stdout, "%.*s\n", static_cast<int>(fname.size()),
+                    fname.data());
     }
     return ret;
 }
 
-HashStatus CheckHash(std::string_view fname, const HashList& hashnames) {
-    const bool print_name = hashnames.size() > 1;
-    auto file = File::Create(fname);
+HashStatus CheckHash(File* file, const AlgorithmList& algorithms) {
+    const std::string_view fname = file->path();
 
     if (!file->is_accessible(false)) {
         WriteLocked(stderr, "Skipping %s (insufficient permissions)\n",
@@ -173,24 +326,26 @@ HashStatus CheckHash(std::string_view fname, const HashList& hashnames) {
     }
 
     HashStatus ret = HashStatus::OK;
-    std::unordered_map<std::string, std::vector<uint8_t>> extant_hashes;
-    for (const auto& hashname : hashnames) {
-        auto extant = file->GetHashMetadata(hashname);
-        if (extant) {
-            extant_hashes[std::string(hashname)] = std::move(extant).value();
+    DigestList expected;
+    AlgorithmList extant;
+    for (const AlgorithmId algorithm : algorithms) {
+        const auto digest = file->GetHashMetadata(algorithm);
+        if (digest) {
+            expected.push_back(*digest);
+            extant.push_back(algorithm);
             continue;
         }
-        WriteLocked(stdout, "Skipping %s (missing %s hash)\n",
-                    std::string(fname).c_str(),
-                    std::string(hashname).c_str());
+        WriteRecord({
+            .path = fname,
+            .algorithm = AlgorithmName(algorithm),
+            .digest = {},
+            .size = RecordSize(file),
+            .nanos = 0,
+            .status = RecordStatus::MISSING,
+        });
         ret = HashStatusMax(ret, HashStatus::ERROR);
     }
-    if (extant_hashes.empty()) return ret;
-
-    std::vector<std::string_view> extant_hashnames;
-    for (const auto& [key, val] : extant_hashes) {
-        extant_hashnames.push_back(key);
-    }
+    if (extant.empty()) return ret;
 
     std::unique_ptr<OpenFile> opened = file->Open();
     if (!opened) {
@@ -198,87 +353,157 @@ HashStatus CheckHash(std::string_view fname, const HashList& hashnames) {
                             std::string(fname).c_str());
         return HashStatus::ERROR;
     }
-    std::unordered_map<std::string, std::vector<uint8_t>> actual_hashes =
-        opened->HashContents(std::span(extant_hashnames));
-    for (const auto& hashname : extant_hashnames) {
-        const std::string hashname_str(hashname);
-        const auto& expected = extant_hashes[hashname_str];
-        const auto& actual = actual_hashes[hashname_str];
-        if (actual != expected) {
-            WriteLocked(stdout, "%s: %s FAILED\n",
-                                std::string(fname).c_str(),
-                                hashname_str.c_str());
-            ret = HashStatusMax(ret, HashStatus::MISMATCH);
-            continue;
-        }
-        WriteLocked(stdout, "%s: %s OK\n", std::string(fname).c_str(),
-                                           std::string(hashname).c_str());
+    const auto start = std::chrono::steady_clock::now();
+    const auto hashed = opened->HashContents(extant);
+    const uint64_t nanos = NanosSince(start);
+    if (!hashed) {
+        WriteLocked(stderr, "Failed to read %s\n",
+                            std::string(fname).c_str());
+        return HashStatus::ERROR;
+    }
+    const DigestList& actual = *hashed;
+    const int64_t size = RecordSize(file);
+    for (size_t i = 0; i < actual.size(); ++i) {
+        const bool matches = actual[i] == expected[i];
+        if (!matches) ret = HashStatusMax(ret, HashStatus::MISMATCH);
+        WriteRecord({
+            .path = fname,
+            .algorithm = AlgorithmName(actual[i].algorithm),
+            .digest = actual[i].view(),
+            .size = size,
+            .nanos = nanos,
+            .status = matches ? RecordStatus::OK : RecordStatus::FAILED,
+        });
     }
 
     return ret;
 }
 
-HashStatus PrintHash(std::string_view fname, const HashList& hashnames) {
-    const bool print_name = hashnames.size() > 1;
+HashStatus PrintHash(File* file, const AlgorithmList& algorithms) {
+    const std::string_view fname = file->path();
 
-    auto file = File::Create(fname);
     if (!file->is_accessible(false)) {
         WriteLocked(stderr, "Skipping %s (insufficient permissions)\n",
                             std::string(fname).c_str());
         return HashStatus::ERROR;
     }
     HashStatus ret = HashStatus::OK;
-    for (const auto hashname : hashnames) {
-        const auto hash = file->GetHashMetadata(hashname);
-        if (!hash) {
+    for (const AlgorithmId algorithm : algorithms) {
+        const auto digest = file->GetHashMetadata(algorithm);
+        if (!digest) {
             ret = HashStatusMax(ret, HashStatus::ERROR);
             continue;
         }
-        if (print_name) {
-            WriteLocked(stdout, "%s [%10s] %s\n",
-                                HashToString(*hash).c_str(),
-                                std::string(hashname).c_str(),
-                                std::string(fname).c_str());
-        } else {
-            WriteLocked(stdout, "%s  %s\n",
-                                HashToString(*hash).c_str(),
-                                std::string(fname).c_str());
-        }
+        WriteRecord({
+            .path = fname,
+            .algorithm = AlgorithmName(algorithm),
+            .digest = digest->view(),
+            .size = RecordSize(file),
+            .nanos = 0,
+            .status = RecordStatus::STORED,
+        });
     }
     return ret;
 }
 
-HashStatus ResetHash(std::string_view fname, const HashList& hashnames) {
-    auto file = File::Create(fname);
+HashStatus ResetHash(File* file, const AlgorithmList& algorithms) {
+    const std::string_view fname = file->path();
     if (!file->is_accessible(true)) {
         WriteLocked(stderr, "Skipping %s (insufficient permissions)\n",
                             std::string(fname).c_str());
         return HashStatus::ERROR;
     }
     HashStatus ret = HashStatus::OK;
-    for (const auto hashname :hashnames) {
-        if (file->RemoveHashMetadata(hashname) != HashResult::OK) {
+    for (const AlgorithmId algorithm : algorithms) {
+        const std::string_view hashname = AlgorithmName(algorithm);
+        if (file->RemoveHashMetadata(algorithm) != HashResult::OK) {
             WriteLocked(stderr, "Failed to reset %s hash on %s\n",
                     std::string(hashname).c_str(),
                     std::string(fname).c_str());
             ret = HashStatusMax(ret, HashStatus::ERROR);
         }
-        WriteLocked(stdout, "Resetting %s hash on %s\n",
-                            std::string(hashname).c_str(),
-                            std::string(fname).c_str());
+        WriteLocked(stdout, "Resetting %.*s hash on %.*s\n",
+                            static_cast<int>(hashname.size()),
+                            hashname.data(),
+                            static_cast<int>(fname.size()), fname.data());
     }
     return ret;
 }
 
 struct ArgResults {
-    HashStatus (*fn)(std::string_view, const HashList&);
+    Mode fn;
     int num_threads;
     int index;
     bool report_all_errors;
-    std::vector<std::string_view> hash_fns;
+    AlgorithmList algorithms;
     bool recurse;
+    size_t largest_first;
+    size_t cached_first;
+    size_t prefetch;
+    bool device_limits;
+    int io_threads;
+    int read_depth;
+    size_t read_chunk;
+    bool auto_threads;
+    bool verbose;
+    bool polite;
+    PressureThresholds pressure;
+    ReadLimits read_limits;
+    std::map<dev_t, ReadLimits> device_read_limits;
+    bool numa;
+    size_t ordered;
+    size_t sorted;
+    OutputFormat format;
+    CachePolicy cache_policy;
+    ReadBackend backend;
+    // -1 for the defaults.
+    int64_t mmap_min;
+    int64_t mmap_max;
+    int64_t direct_min;
+    // What --calibrate found for the disk holding the first path, if any.
+    std::optional<DeviceTuning> tuning;
 };
 
+// Values for options which only have a long form.
+enum LongOption : int {
+    kLargestFirst = 256,
+    kCachedFirst,
+    kPrefetch,
+    kDeviceLimits,
+    kIoThreads,
+    kReadDepth,
+    kReadChunk,
+    kAutoThreads,
+    kPolite,
+    kPressure,
+    kMaxBytesPerSec,
+    kMaxFilesPerSec,
+    kNuma,
+    kOrdered,
+    kSorted,
+    kFormat,
+    kCachePolicy,
+    kBackend,
+    kMmapMin,
+    kMmapMax,
+    kDirectMin,
+    kBenchBackends,
+    kBenchHex,
+    kBenchDigests,
+    kCalibrate,
+};
+
+constexpr size_t kDefaultLookahead = 16384;
+constexpr size_t kDefaultCachedLookahead = 1024;
+constexpr size_t kDefaultPrefetchBudget = 64 << 20;
+constexpr size_t kPrefetchFileBytes = 1 << 20;
+constexpr size_t kMaxDevicePending = 4096;
+constexpr size_t kMaxNumaPending = 1024;
+constexpr size_t kDefaultReorderBuffer = 64 << 20;
+constexpr size_t kDefaultSortBuffer = 512 << 20;
+constexpr size_t kPipelineChunkSize = 1 << 20;
+constexpr size_t kPipelineDepth = 4;
+
 void ShowHelp(char* progname) {
     const std::string default_hashes([]() -> std::string {
         const auto hashes = DefaultHashes();
@@ -292,14 +517,27 @@ void ShowHelp(char* progname) {
     }());
 
     printf("%s [-c] [-h] [-r] [-s] [-p] [-t NUM] [-T] [-e] [-E] [-C hashname] "
-           "[-R] filenames...\n", progname);
+           "[-R] [-v] filenames...\n", progname);
     printf("\n");
     printf("\t-C NAME: Set hashing function to NAME. (default=%s)\n",
             default_hashes.c_str());
+    printf("\t         One of");
+    for (const Algorithm& algorithm : kAlgorithms) {
+        printf(" %.*s", static_cast<int>(algorithm.name.size()),
+               algorithm.name.data());
+    }
+    printf("\n");
+    printf("\t         or another name OpenSSL has for one, in any case. "
+           "Digests\n");
+    printf("\t         are stored under the name above: ones stored under "
+           "another\n");
+    printf("\t         spelling (e.g. %shash.SHA256) are not found.\n",
+           ATTR_PREFIX);
     printf("\t-E:      Only report error if a file has a bad hash\n");
     printf("\t-H:      Identify whether files have hashes\n");
     printf("\t-R:      Operate recursively over directories.\n");
-    printf("\t-T:      Use one worker thread per CPU\n");
+    printf("\t-T:      Use one worker thread per CPU we may use (%d)\n",
+           GetResourceLimits().DefaultThreads());
     printf("\t-c:      Check hashes\n");
     printf("\t-e:      Report all errors (even missing data errors)\n");
     printf("\t-h:      Show this help\n");
@@ -307,6 +545,137 @@ void ShowHelp(char* progname) {
     printf("\t-r:      Reset hashes (remove hash from file's metadata)\n");
     printf("\t-s:      Set hash (Find file's hash and set it in files metadata)\n");
     printf("\t-t NUM:  Use NUM threads\n");
+    printf("\t-v:      Describe the CPU and I/O limits that apply to us\n");
+    printf("\n");
+    printf("\t--largest-first[=NUM]: Hash the largest files first, looking "
+           "NUM files ahead (default=%zu)\n", kDefaultLookahead);
+    printf("\t--cached-first[=NUM]:  Hash files already in the page cache "
+           "first,\n"
+           "\t                       looking NUM files ahead "
+           "(default=%zu)\n", kDefaultCachedLookahead);
+    printf("\t--prefetch[=SIZE]:     Start reading the first %zuM of "
+           "upcoming files\n"
+           "\t                       early, up to SIZE bytes ahead of the "
+           "workers\n"
+           "\t                       (default=%zuM)\n",
+           kPrefetchFileBytes >> 20, kDefaultPrefetchBudget >> 20);
+    printf("\t--device-limits:       Limit how many files are read at once "
+           "from each disk\n");
+    printf("\t--io-threads=NUM:      Read files on NUM separate threads, and "
+           "only hash\n"
+           "\t                       on the -t/-T workers (with -s and -c)\n");
+    printf("\t--read-depth=NUM:      Keep NUM reads in flight within each "
+           "file of at\n"
+           "\t                       least two chunks, hashing the chunks "
+           "in order, with\n"
+           "\t                       the read, auto or parallel backend "
+           "(default: as\n"
+           "\t                       calibrated, or 1)\n");
+    printf("\t--read-chunk=SIZE:     Read SIZE bytes at a time with "
+           "--read-depth\n"
+           "\t                       (default: as calibrated, or 1M)\n");
+    printf("\t--auto-threads:        Tune the number of running workers to "
+           "the\n"
+           "\t                       throughput, using at most -t/-T\n");
+    printf("\t--polite:              Run at idle CPU and I/O priority, and "
+           "back off\n"
+           "\t                       while other tasks stall (pressure in "
+           "our own\n"
+           "\t                       cgroup, or else what pausing once shows "
+           "to be\n"
+           "\t                       ours, does not count)\n");
+    printf("\t--pressure=RES:PCT,... Back off when RES (io, cpu or memory) "
+           "stalls\n"
+           "\t                       more than PCT%% of the time (implies "
+           "--polite,\n"
+           "\t                       default=io:%.0f,cpu:%.0f,memory:%.0f)\n",
+           PressureThresholds().io, PressureThresholds().cpu,
+           PressureThresholds().memory);
+    printf("\t--max-bytes-per-sec=SIZE[@PATH]: Read at most SIZE bytes (eg "
+           "200M) a\n"
+           "\t                       second, in total or from the device "
+           "holding PATH\n");
+    printf("\t--max-files-per-sec=NUM[@PATH]:  Open at most NUM files a "
+           "second, in\n"
+           "\t                       total or from the device holding "
+           "PATH\n");
+    printf("\t--numa:                Pin threads to NUMA nodes in turn, and "
+           "have them\n"
+           "\t                       prefer files on disks attached to "
+           "their node\n");
+    printf("\t--cache-policy=POLICY: keep (the default) leaves the page cache "
+           "to the\n"
+           "\t                       kernel, sequential asks for more "
+           "readahead, drop\n"
+           "\t                       also drops what was read from the "
+           "cache, and\n"
+           "\t                       preserve only drops what was not cached "
+           "before\n");
+    printf("\t--backend=BACKEND:     Read files with read (the default), "
+           "mmap, direct\n"
+           "\t                       (O_DIRECT) or parallel preads, or "
+           "choose for each\n"
+           "\t                       file (auto); kernel hashes in the "
+           "kernel where it\n"
+           "\t                       has the algorithms, and reads "
+           "otherwise. With mmap\n"
+           "\t                       or auto, a file truncated while it is "
+           "hashed kills\n"
+           "\t                       the run (SIGBUS)\n");
+    printf("\t--mmap-min=SIZE, --mmap-max=SIZE: With auto, map cached files "
+           "of\n"
+           "\t                       sizes in this range; --mmap-max=0 never "
+           "does\n"
+           "\t                       (default: as --bench-backends found, or "
+           "%lldK-%lldM)\n",
+           static_cast<long long>(DefaultBackendThresholds().mmap_min >> 10),
+           static_cast<long long>(DefaultBackendThresholds().mmap_max >> 20));
+    printf("\t--direct-min=SIZE:     With auto, read uncached files from "
+           "SIZE up with\n"
+           "\t                       O_DIRECT; 0 never does (default: as\n"
+           "\t                       --bench-backends found, or never)\n");
+    printf("\t--ordered[=SIZE]:      Print results in the order files were "
+           "given or\n"
+           "\t                       found, holding back at most about SIZE "
+           "bytes\n"
+           "\t                       of early results (default=%zuM)\n",
+           kDefaultReorderBuffer >> 20);
+    printf("\t--sorted[=SIZE]:       Print results sorted by file name, "
+           "sorting up to\n"
+           "\t                       SIZE bytes at a time in memory and "
+           "merging\n"
+           "\t                       through files in $TMPDIR "
+           "(default=%zuM)\n",
+           kDefaultSortBuffer >> 20);
+    printf("\t--format=FORMAT:       Write results as text (the default), "
+           "jsonl (one\n"
+           "\t                       JSON object per line) or binary "
+           "records\n");
+    printf("\t--bench-hex:           Time hex encoding of digests, and "
+           "exit\n");
+    printf("\t--bench-digests:       Time each implementation of each hash "
+           "function,\n"
+           "\t                       save the fastest for later runs to use, "
+           "and exit\n");
+    printf("\t--bench-backends[=DIR]: Time each --backend on files written "
+           "under DIR\n"
+           "\t                       (default=.), save the thresholds for "
+           "auto, and exit\n");
+    printf("\t--calibrate=PATH:      Time reads of the files under PATH, "
+           "save the best\n"
+           "\t                       buffer size, depth and thread count "
+           "for its disk\n"
+           "\t                       for later runs (and -T) to use, and "
+           "exit\n");
+}
+
+// Returns the calibrated settings for the disk holding the first of paths (or
+// the current directory, if there are none).
+std::optional<DeviceTuning> FirstPathTuning(char* const* paths) {
+    if (!HaveDeviceTunings()) return std::nullopt;
+    struct stat sb;
+    if (stat(*paths ? *paths : ".", &sb)) return std::nullopt;
+    return GetDeviceTuning(sb.st_dev);
 }
 
 ArgResults ParseArgs(int argc, char* const* argv) {
@@ -315,12 +684,65 @@ ArgResults ParseArgs(int argc, char* const* argv) {
         .num_threads = 1,
         .index = 0,
         .report_all_errors = false,
-        .hash_fns = {},
+        .algorithms = {},
         .recurse = false,
+        .largest_first = 0,
+        .cached_first = 0,
+        .prefetch = 0,
+        .device_limits = false,
+        .io_threads = 0,
+        .read_depth = 0,
+        .read_chunk = 0,
+        .auto_threads = false,
+        .verbose = false,
+        .polite = false,
+        .pressure = {},
+        .read_limits = {},
+        .device_read_limits = {},
+        .numa = false,
+        .ordered = 0,
+        .sorted = 0,
+        .format = OutputFormat::TEXT,
+        .cache_policy = CachePolicy::KEEP,
+        .backend = ReadBackend::READ,
+        .mmap_min = -1,
+        .mmap_max = -1,
+        .direct_min = -1,
+        .tuning = std::nullopt,
+    };
+
+    static const struct option kLongOptions[] = {
+        {"largest-first", optional_argument, nullptr, kLargestFirst},
+        {"cached-first", optional_argument, nullptr, kCachedFirst},
+        {"prefetch", optional_argument, nullptr, kPrefetch},
+        {"device-limits", no_argument, nullptr, kDeviceLimits},
+        {"io-threads", required_argument, nullptr, kIoThreads},
+        {"read-depth", required_argument, nullptr, kReadDepth},
+        {"read-chunk", required_argument, nullptr, kReadChunk},
+        {"auto-threads", no_argument, nullptr, kAutoThreads},
+        {"polite", no_argument, nullptr, kPolite},
+        {"pressure", required_argument, nullptr, kPressure},
+        {"max-bytes-per-sec", required_argument, nullptr, kMaxBytesPerSec},
+        {"max-files-per-sec", required_argument, nullptr, kMaxFilesPerSec},
+        {"numa", no_argument, nullptr, kNuma},
+        {"ordered", optional_argument, nullptr, kOrdered},
+        {"sorted", optional_argument, nullptr, kSorted},
+        {"format", required_argument, nullptr, kFormat},
+        {"cache-policy", required_argument, nullptr, kCachePolicy},
+        {"backend", required_argument, nullptr, kBackend},
+        {"mmap-min", required_argument, nullptr, kMmapMin},
+        {"mmap-max", required_argument, nullptr, kMmapMax},
+        {"direct-min", required_argument, nullptr, kDirectMin},
+        {"bench-backends", optional_argument, nullptr, kBenchBackends},
+        {"bench-hex", no_argument, nullptr, kBenchHex},
+        {"bench-digests", no_argument, nullptr, kBenchDigests},
+        {"calibrate", required_argument, nullptr, kCalibrate},
+        {nullptr, 0, nullptr, 0},
     };
 
     while (true) {
-        switch (getopt(argc, argv, "chrspt:TeEC:RH")) {
+        switch (getopt_long(argc, argv, "chrspt:TeEC:RHv", kLongOptions,
+                            nullptr)) {
             case 'T': ret.num_threads = -1;                continue;
             case 'c': ret.fn = &CheckHash;                 continue;
             case 'p': ret.fn = &PrintHash;                 continue;
@@ -328,10 +750,90 @@ ArgResults ParseArgs(int argc, char* const* argv) {
             case 's': ret.fn = &ApplyHash;                 continue;
             case 'H': ret.fn = &HasHash;                   continue;
             case 'R': ret.recurse = true;                  continue;
-            case 'C': ret.hash_fns.push_back(optarg);      continue;
+            case 'v': ret.verbose = true;                  continue;
+            case 'C': AddAlgorithm(&ret.algorithms, optarg); continue;
             case 't': ret.num_threads = ParseInt(optarg);  continue;
             case 'e': ret.report_all_errors = true;        continue;
             case 'E': ret.report_all_errors = false;       continue;
+            case kLargestFirst:
+                ret.largest_first =
+                    optarg ? ParseInt(optarg) : kDefaultLookahead;
+                continue;
+            case kCachedFirst:
+                ret.cached_first =
+                    optarg ? ParseInt(optarg) : kDefaultCachedLookahead;
+                continue;
+            case kPrefetch:
+                ret.prefetch =
+                    optarg ? ParseSize(optarg) : kDefaultPrefetchBudget;
+                continue;
+            case kDeviceLimits: ret.device_limits = true;  continue;
+            case kIoThreads: ret.io_threads = ParseInt(optarg); continue;
+            case kReadDepth: ret.read_depth = ParseInt(optarg); continue;
+            case kReadChunk: ret.read_chunk = ParseSize(optarg); continue;
+            case kAutoThreads: ret.auto_threads = true;    continue;
+            case kPolite: ret.polite = true;               continue;
+            case kPressure:
+                ret.polite = true;
+                ret.pressure = ParsePressure(optarg, ret.pressure);
+                continue;
+            case kNuma: ret.numa = true;                   continue;
+            case kOrdered:
+                ret.ordered = optarg ? ParseSize(optarg) : kDefaultReorderBuffer;
+                ret.sorted = 0;
+                continue;
+            case kSorted:
+                ret.sorted = optarg ? ParseSize(optarg) : kDefaultSortBuffer;
+                ret.ordered = 0;
+                continue;
+            case kCachePolicy: {
+                const auto policy = ParseCachePolicy(optarg);
+                if (!policy) QUIT("Unknown cache policy: %s\n", optarg);
+                ret.cache_policy = *policy;
+                continue;
+            }
+            case kBackend: {
+                const auto backend = ParseReadBackend(optarg);
+                if (!backend) QUIT("Unknown backend: %s\n", optarg);
+                ret.backend = *backend;
+                continue;
+            }
+            case kMmapMin:
+                ret.mmap_min = strcmp(optarg, "0") ? ParseSize(optarg) : 0;
+                continue;
+            case kMmapMax:
+                ret.mmap_max = strcmp(optarg, "0") ? ParseSize(optarg) : 0;
+                continue;
+            case kDirectMin:
+                ret.direct_min = strcmp(optarg, "0") ? ParseSize(optarg) : 0;
+                continue;
+            case kFormat: {
+                const auto format = ParseOutputFormat(optarg);
+                if (!format) QUIT("Unknown format: %s\n", optarg);
+                ret.format = *format;
+                continue;
+            }
+            case kMaxBytesPerSec: {
+                const auto [value, dev] = SplitDevice(optarg);
+                auto& limits =
+                    dev ? ret.device_read_limits[*dev] : ret.read_limits;
+                limits.bytes_per_sec = ParseSize(value);
+                continue;
+            }
+            case kMaxFilesPerSec: {
+                const auto [value, dev] = SplitDevice(optarg);
+                auto& limits =
+                    dev ? ret.device_read_limits[*dev] : ret.read_limits;
+                limits.files_per_sec = ParseInt(value);
+                continue;
+            }
+            case kBenchHex: BenchmarkHex(); exit(0);       break;
+            case kBenchDigests: BenchmarkDigests(); exit(0); break;
+            case kBenchBackends:
+                BenchmarkBackends(optarg ? optarg : ".");
+                exit(0);
+                break;
+            case kCalibrate: exit(Calibrate(optarg) ? 0 : 1); break;
             case 'h': ShowHelp(argv[0]); exit(0);          break;
             case -1:                                       break;
             default: exit(1);
@@ -339,8 +841,17 @@ ArgResults ParseArgs(int argc, char* const* argv) {
         break;
     }
     ret.index = optind;
-    if (ret.hash_fns.empty()) ret.hash_fns = DefaultHashes();
-    if (ret.num_threads <= 0) ret.num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ret.algorithms.empty()) {
+        for (const auto name : DefaultHashes()) {
+            AddAlgorithm(&ret.algorithms, name);
+        }
+    }
+    ResolveAlgorithms(ret.algorithms);
+    ret.tuning = FirstPathTuning(&argv[ret.index]);
+    if (ret.num_threads <= 0) {
+        ret.num_threads = ret.tuning ? ret.tuning->threads
+                                     : GetResourceLimits().DefaultThreads();
+    }
     if (ret.fn) return ret;
 
     char* const fname = basename(*argv);
@@ -349,31 +860,138 @@ ArgResults ParseArgs(int argc, char* const* argv) {
 
     return ret;
 }
+
+template <Mode mode>
+void RunMode(const ArgResults& results, FnameIterator* iterator,
+             const WorkerContext& ctx) {
+    // Only setting and checking read file contents, so only they benefit
+    // from a separate I/O stage.
+    constexpr bool reads = mode == &ApplyHash || mode == &CheckHash;
+    if (reads && results.io_threads) {
+        ReadPipeline pipeline(iterator, results.io_threads,
+                              results.io_threads, kPipelineChunkSize,
+                              kPipelineDepth, results.numa);
+        pipeline.Start();
+        RunWorkers(&PipelineWorker<mode>, &pipeline, results.num_threads, ctx);
+    } else {
+        RunWorkers(&Worker<mode>, iterator, results.num_threads, ctx);
+    }
+}
+
+// Runs the workers for results.fn until they run out of files.
+void RunMode(const ArgResults& results, FnameIterator* iterator,
+             const WorkerContext& ctx) {
+    if (results.fn == &ApplyHash) {
+        return RunMode<&ApplyHash>(results, iterator, ctx);
+    }
+    if (results.fn == &CheckHash) {
+        return RunMode<&CheckHash>(results, iterator, ctx);
+    }
+    if (results.fn == &PrintHash) {
+        return RunMode<&PrintHash>(results, iterator, ctx);
+    }
+    if (results.fn == &HasHash) {
+        return RunMode<&HasHash>(results, iterator, ctx);
+    }
+    if (results.fn == &ResetHash) {
+        return RunMode<&ResetHash>(results, iterator, ctx);
+    }
+    QUIT("Unhandled mode in %s\n", __func__);
+}
 }
 
 int main(int argc, char* argv[]) {
     auto results = ParseArgs(argc, &argv[0]);
     if (!results.fn) return 1;
+    if (results.verbose) {
+        PrintResourceLimits(stderr);
+        if (results.tuning) {
+            fprintf(stderr, "Calibrated for %s\n",
+                    DescribeTuning(*results.tuning).c_str());
+        }
+        fprintf(stderr, "Using %d threads\n", results.num_threads);
+    }
+    // Before starting any threads, so that they all inherit it.
+    if (results.polite && lower_priority()) DIE("lower_priority");
+    std::unique_ptr<RecordSink> sink;
+    if (results.ordered) {
+        sink = std::make_unique<OrderedOutput>(results.ordered);
+    } else if (results.sorted) {
+        sink = std::make_unique<SortedOutput>(results.sorted);
+    }
+    if (sink) SetRecordSink(sink.get());
+    SetOutputFormat(results.format, results.algorithms.size() > 1);
+    SetGlobalReadLimits(results.read_limits);
+    for (const auto& [dev, limits] : results.device_read_limits) {
+        SetDeviceReadLimits(dev, limits);
+    }
+    SetParallelReads(results.read_depth, results.read_chunk);
+    SetCachePolicy(results.cache_policy);
+    BackendThresholds thresholds = DefaultBackendThresholds();
+    if (results.mmap_min >= 0) thresholds.mmap_min = results.mmap_min;
+    if (results.mmap_max >= 0) thresholds.mmap_max = results.mmap_max;
+    if (results.direct_min >= 0) thresholds.direct_min = results.direct_min;
+    SetReadBackend(results.backend, thresholds);
 
     auto iterator =
         FnameIterator::GetInstance(results.recurse, &argv[results.index]);
     if (!iterator) return 1;
+    if (results.largest_first) {
+        iterator = LargestFirst(std::move(iterator), results.largest_first);
+    }
+    // After LargestFirst, so that cached files still go first.
+    if (results.cached_first) {
+        iterator = CachedFirst(std::move(iterator), results.cached_first);
+    }
+    // Inside NumaAffine, which hands files out by the calling thread's node
+    // and so has to be called by the workers themselves.
+    if (results.prefetch) {
+        iterator = Prefetching(std::move(iterator), results.prefetch,
+                               kPrefetchFileBytes);
+    }
+    if (results.numa) {
+        iterator = NumaAffine(std::move(iterator), kMaxNumaPending);
+    }
+    if (results.device_limits) {
+        iterator = DeviceLimited(std::move(iterator), kMaxDevicePending);
+    }
     iterator->Start();
 
-    std::vector<std::thread> workers;
-    workers.reserve(results.num_threads);
     std::atomic<unsigned> result;
 
-    for (unsigned i = 1; i < results.num_threads; ++i) {
-        workers.emplace_back(&Worker,
-                             iterator.get(),
-                             results.hash_fns,
-                             results.fn,
-                             &result);
-    }
-    Worker(iterator.get(), results.hash_fns, results.fn, &result);
+    // With --auto-threads, -t/-T is only the ceiling. Start from one worker
+    // per CPU and let the tuner find the best level from there.
+    const int start_level = results.auto_threads
+        ? std::min(results.num_threads, GetResourceLimits().DefaultThreads())
+        : results.num_threads;
+    WorkerGate gate(start_level);
+    AutoTuner tuner(&gate, results.num_threads);
+    if (results.auto_threads) tuner.Start();
+    PressureMonitor monitor(&gate, results.num_threads, results.pressure);
+    if (results.polite) monitor.Start();
+
+    const WorkerContext ctx = {
+        .algorithms = results.algorithms,
+        .gate = &gate,
+        .numa = results.numa,
+        .ret = &result,
+    };
 
-    for (auto& thread : workers) thread.join();
+    RunMode(results, iterator.get(), ctx);
+    tuner.Stop();
+    monitor.Stop();
+    if (sink) sink->Finish();
+    if (results.polite) {
+        WriteLocked(stderr, "Throttled for %.1fs (paused for %.1fs)\n",
+                    monitor.throttled().count(), monitor.paused().count());
+    }
+    if (results.cache_policy == CachePolicy::DROP ||
+        results.cache_policy == CachePolicy::PRESERVE) {
+        const auto* const counters = GlobalCounters();
+        WriteLocked(stderr, "Dropped %.1f MB from the page cache (kept %.1f "
+                    "MB)\n", counters->bytes_evicted.load() / 1e6,
+                    counters->bytes_kept.load() / 1e6);
+    }
 
     if (results.report_all_errors) return result.load();
     return result.load() & static_cast<unsigned>(HashStatus::MISMATCH);
@@ -0,0 +1,31 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string_view>
+
+// Writes the lowercase hex form of bytes (len * 2 chars, no terminator) to
+// out. Uses AVX2 or SSSE3 when the CPU has them.
+void HexEncode(const uint8_t* bytes, size_t len, char* out);
+
+// The plain lookup table version, which HexEncode falls back to.
+void HexEncodeTable(const uint8_t* bytes, size_t len, char* out);
+
+// Names the version HexEncode uses: "avx2", "ssse3" or "table".
+std::string_view HexEncodeName();
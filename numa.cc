@@ -0,0 +1,124 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "numa.h"
+
+#include <stdio.h>
+
+#include <vector>
+
+#include "common.h"
+
+namespace {
+thread_local int current_node = -1;
+}
+
+#if defined(__linux__)
+
+#include <dirent.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+// Parses a cpulist like "0-3,8-11".
+std::vector<int> ParseCpuList(const char* list) {
+    std::vector<int> ret;
+    while (*list) {
+        char* end;
+        const long first = strtol(list, &end, 10);
+        if (end == list) break;
+        long last = first;
+        if (*end == '-') last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last; ++cpu) ret.push_back(cpu);
+        list = end;
+        if (*list == ',') ++list;
+    }
+    return ret;
+}
+
+std::vector<std::vector<int>> ReadNodes() {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) CPU_ZERO(&allowed);
+
+    std::vector<std::vector<int>> ret;
+    DIR* const dir = opendir("/sys/devices/system/node");
+    if (!dir) return ret;
+    const Cleanup closer([dir]() { closedir(dir); });
+
+    while (const struct dirent* const entry = readdir(dir)) {
+        int node;
+        if (sscanf(entry->d_name, "node%d", &node) != 1) continue;
+
+        LOCAL_STRING(path, "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* const f = fopen(path, "r");
+        if (!f) continue;
+        char list[4096] = {};
+        const bool read = fgets(list, sizeof(list), f) != nullptr;
+        fclose(f);
+        if (!read) continue;
+
+        if (ret.size() <= node) ret.resize(node + 1);
+        for (const int cpu : ParseCpuList(list)) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+                ret[node].push_back(cpu);
+            }
+        }
+    }
+    return ret;
+}
+}
+
+void PinToNumaNode(int n) {
+    const auto& nodes = NumaNodes();
+    const int usable = NumUsableNumaNodes();
+    if (usable == 0) return;
+
+    int want = n % usable;
+    for (int node = 0; node < nodes.size(); ++node) {
+        if (nodes[node].empty()) continue;
+        if (want--) continue;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (const int cpu : nodes[node]) CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set)) DIE("sched_setaffinity");
+        current_node = node;
+        return;
+    }
+}
+
+#else
+
+namespace {
+std::vector<std::vector<int>> ReadNodes() { return {}; }
+}
+
+void PinToNumaNode(int n) {}
+
+#endif
+
+const std::vector<std::vector<int>>& NumaNodes() {
+    static const std::vector<std::vector<int>> nodes = ReadNodes();
+    return nodes;
+}
+
+int NumUsableNumaNodes() {
+    int ret = 0;
+    for (const auto& cpus : NumaNodes()) ret += !cpus.empty();
+    return ret;
+}
+
+int CurrentNumaNode() { return current_node; }
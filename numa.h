@@ -0,0 +1,33 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <vector>
+
+// The CPUs of each NUMA node that we may run on, indexed by node number.
+// Nodes that have none of our CPUs are left empty. Found through sysfs, so
+// there is no dependency on libnuma; without NUMA this is a single node.
+const std::vector<std::vector<int>>& NumaNodes();
+
+// The number of nodes that have some of our CPUs.
+int NumUsableNumaNodes();
+
+// Restricts the calling thread to the CPUs of the n-th usable node, counting
+// round robin, so that memory it touches from then on is local to that node.
+void PinToNumaNode(int n);
+
+// The node the calling thread was pinned to, or -1 if it was not.
+int CurrentNumaNode();
@@ -0,0 +1,333 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+
+namespace {
+// Records that are ready are collected and written in chunks of this size.
+constexpr size_t kFlushSize = 64 << 10;
+// Bounds on the buffer for reading or writing a sorted run, which otherwise
+// gets an even share of max_buffered with kMaxMergeRuns others.
+constexpr size_t kRunBufferSize = 1 << 20;
+constexpr size_t kMinRunBufferSize = 16 << 10;
+// How many runs of one level are merged into one of the next.
+constexpr size_t kMergeRuns = 16;
+// The most runs Finish() merges at once, which is also about the most that
+// are ever kept: kMergeRuns - 1 for each level.
+constexpr size_t kMaxMergeRuns = 64;
+
+// Collects output and writes it out in kFlushSize pieces.
+class Writer {
+  public:
+    ~Writer() { WriteDirect(stdout, out_); }
+
+    void Write(std::string_view data) {
+        out_ += data;
+        if (out_.size() < kFlushSize) return;
+        WriteDirect(stdout, out_);
+        out_.clear();
+    }
+
+  private:
+    std::string out_;
+};
+
+// Creates an anonymous temporary file in $TMPDIR (or /tmp).
+int CreateRunFile() {
+    const char* const dir = getenv("TMPDIR");
+    std::string path = std::string(dir && *dir ? dir : "/tmp") +
+                       "/hasher-sort.XXXXXX";
+    const int fd = mkstemp(path.data());
+    if (fd == -1) DIE("mkstemp");
+    unlink(path.c_str());
+    return fd;
+}
+
+// A stdio stream on fd, using a buffer of its own, which closes fd when it
+// is done.
+class RunStream {
+  public:
+    RunStream(int fd, const char* mode, size_t buffer_size)
+        : buffer_(std::make_unique_for_overwrite<char[]>(buffer_size)),
+          f_(fdopen(fd, mode)) {
+        if (!f_) DIE("fdopen");
+        setvbuf(f_, buffer_.get(), _IOFBF, buffer_size);
+    }
+    ~RunStream() {
+        if (fclose(f_)) DIE("fclose");
+    }
+    RunStream(const RunStream&) = delete;
+    RunStream& operator=(const RunStream&) = delete;
+
+    FILE* get() const { return f_; }
+
+  private:
+    const std::unique_ptr<char[]> buffer_;
+    FILE* f_;
+};
+
+void WriteRun(FILE* f, std::string_view key, std::string_view data) {
+    const uint32_t lens[] = {
+        static_cast<uint32_t>(key.size()),
+        static_cast<uint32_t>(data.size()),
+    };
+    if (fwrite(lens, sizeof(lens), 1, f) != 1 ||
+        fwrite(key.data(), 1, key.size(), f) != key.size() ||
+        fwrite(data.data(), 1, data.size(), f) != data.size()) {
+        DIE("fwrite");
+    }
+}
+
+// Reads back one run written by WriteRun, a record at a time.
+class RunReader {
+  public:
+    RunReader(int fd, size_t buffer_size) : stream_(fd, "r", buffer_size) {
+        if (fseeko(stream_.get(), 0, SEEK_SET)) DIE("rewind run");
+    }
+
+    // Returns false at the end of the run.
+    bool Next() {
+        FILE* const f = stream_.get();
+        uint32_t lens[2];
+        const size_t got = fread(lens, sizeof(lens), 1, f);
+        if (got != 1) {
+            if (ferror(f)) DIE("fread");
+            return false;
+        }
+        record_.resize(lens[0] + lens[1]);
+        if (fread(record_.data(), 1, record_.size(), f) != record_.size()) {
+            DIE("fread");
+        }
+        key_len_ = lens[0];
+        return true;
+    }
+
+    std::string_view key() const {
+        return std::string_view(record_).substr(0, key_len_);
+    }
+    std::string_view data() const {
+        return std::string_view(record_).substr(key_len_);
+    }
+
+  private:
+    RunStream stream_;
+    std::string record_;
+    size_t key_len_ = 0;
+};
+
+// Returns a stream for writing run, which stays open when the stream is
+// closed.
+std::unique_ptr<RunStream> WriteRunFile(int run, size_t buffer_size) {
+    const int fd = dup(run);
+    if (fd == -1) DIE("dup");
+    return std::make_unique<RunStream>(fd, "w", buffer_size);
+}
+
+// Merges runs, calling write with the key and contents of each of their
+// records in order, and closes them.
+template <typename Fn>
+void MergeRuns(std::span<const int> runs, size_t buffer_size,
+               const Fn& write) {
+    std::vector<std::unique_ptr<RunReader>> readers;
+    for (const int run : runs) {
+        readers.push_back(std::make_unique<RunReader>(run, buffer_size));
+    }
+
+    // A min-heap of the readers, by their current record.
+    const auto later = [&readers](size_t a, size_t b) {
+        const RunReader& ra = *readers[a];
+        const RunReader& rb = *readers[b];
+        if (ra.key() != rb.key()) return ra.key() > rb.key();
+        return ra.data() > rb.data();
+    };
+    std::priority_queue<size_t, std::vector<size_t>, decltype(later)> heap(
+        later);
+    for (size_t i = 0; i < readers.size(); ++i) {
+        if (readers[i]->Next()) heap.push(i);
+    }
+    while (!heap.empty()) {
+        const size_t i = heap.top();
+        heap.pop();
+        write(readers[i]->key(), readers[i]->data());
+        if (readers[i]->Next()) heap.push(i);
+    }
+}
+}  // namespace
+
+OrderedOutput::OrderedOutput(size_t max_buffered)
+    : max_buffered_(max_buffered) {}
+
+OrderedOutput::~OrderedOutput() = default;
+
+void OrderedOutput::Finish() {
+    const std::lock_guard<std::mutex> l(mu_);
+    WriteDirect(stdout, out_);
+    out_.clear();
+}
+
+void OrderedOutput::Begin(uint64_t seq) {
+    std::unique_lock<std::mutex> l(mu_);
+    cv_.wait(l, [&]() {
+        return held_bytes_ <= max_buffered_ || seq == next_ ||
+               !active_.contains(next_);
+    });
+    active_.insert(seq);
+}
+
+void OrderedOutput::Add(uint64_t seq, std::string_view key,
+                        std::string_view data) {
+    std::unique_lock<std::mutex> l(mu_);
+    active_.erase(seq);
+    if (seq != next_) {
+        held_bytes_ += data.size();
+        held_.emplace(seq, data);
+        return;
+    }
+
+    // Write out this record and everything it was holding up.
+    out_ += data;
+    ++next_;
+    for (auto it = held_.begin();
+         it != held_.end() && it->first == next_;
+         it = held_.erase(it), ++next_) {
+        out_ += it->second;
+        held_bytes_ -= it->second.size();
+    }
+    if (out_.size() >= kFlushSize) {
+        WriteDirect(stdout, out_);
+        out_.clear();
+    }
+    l.unlock();
+    cv_.notify_all();
+}
+
+SortedOutput::SortedOutput(size_t max_buffered)
+    : max_buffered_(max_buffered),
+      run_buffer_size_(std::clamp(max_buffered / (kMaxMergeRuns + 1),
+                                  kMinRunBufferSize, kRunBufferSize)) {}
+
+SortedOutput::~SortedOutput() {
+    for (const Run& run : runs_) close(run.fd);
+}
+
+std::string_view SortedOutput::Key(const Record& r) const {
+    return std::string_view(arena_).substr(r.offset, r.key_len);
+}
+
+std::string_view SortedOutput::Data(const Record& r) const {
+    return std::string_view(arena_).substr(r.offset + r.key_len, r.data_len);
+}
+
+void SortedOutput::Add(uint64_t seq, std::string_view key,
+                       std::string_view data) {
+    const std::lock_guard<std::mutex> l(mu_);
+    records_.push_back({
+        .offset = arena_.size(),
+        .key_len = static_cast<uint32_t>(key.size()),
+        .data_len = static_cast<uint32_t>(data.size()),
+    });
+    arena_ += key;
+    arena_ += data;
+    const size_t held = arena_.size() + records_.size() * sizeof(Record);
+    // The other workers wait while we spill, which keeps memory bounded.
+    if (held >= max_buffered_) Spill();
+}
+
+void SortedOutput::Sort() {
+    std::sort(records_.begin(), records_.end(),
+              [this](const Record& a, const Record& b) {
+                  const auto ka = Key(a), kb = Key(b);
+                  if (ka != kb) return ka < kb;
+                  return Data(a) < Data(b);
+              });
+}
+
+void SortedOutput::Spill() {
+    Sort();
+    const int run = CreateRunFile();
+    {
+        const auto out = WriteRunFile(run, run_buffer_size_);
+        for (const Record& r : records_) WriteRun(out->get(), Key(r), Data(r));
+    }
+    runs_.push_back({.fd = run, .level = 0});
+    records_.clear();
+    arena_.clear();
+
+    // Like carrying in a sum: whenever the last kMergeRuns runs are of one
+    // level, they become one of the next.
+    while (runs_.size() >= kMergeRuns &&
+           runs_[runs_.size() - kMergeRuns].level == runs_.back().level) {
+        MergeLast(kMergeRuns);
+    }
+}
+
+void SortedOutput::MergeLast(size_t count) {
+    const int merged = CreateRunFile();
+    std::vector<int> fds;
+    for (size_t i = runs_.size() - count; i < runs_.size(); ++i) {
+        fds.push_back(runs_[i].fd);
+    }
+    {
+        const auto out = WriteRunFile(merged, run_buffer_size_);
+        MergeRuns(fds, run_buffer_size_,
+                  [&out](std::string_view key, std::string_view data) {
+                      WriteRun(out->get(), key, data);
+                  });
+    }
+    const int level = runs_[runs_.size() - count].level + 1;
+    runs_.resize(runs_.size() - count);
+    runs_.push_back({.fd = merged, .level = level});
+}
+
+void SortedOutput::Finish() {
+    const std::lock_guard<std::mutex> l(mu_);
+    Writer out;
+    if (runs_.empty()) {
+        // It all fit in memory.
+        Sort();
+        for (const Record& r : records_) out.Write(Data(r));
+        records_.clear();
+        arena_.clear();
+        return;
+    }
+
+    if (!records_.empty()) Spill();
+    records_.shrink_to_fit();
+    arena_.shrink_to_fit();
+
+    while (runs_.size() > kMaxMergeRuns) MergeLast(kMaxMergeRuns);
+    std::vector<int> fds;
+    for (const Run& run : runs_) fds.push_back(run.fd);
+    runs_.clear();
+    MergeRuns(fds, run_buffer_size_,
+              [&out](std::string_view, std::string_view data) {
+                  out.Write(data);
+              });
+}
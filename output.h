@@ -0,0 +1,106 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "common.h"
+
+// Writes records out in sequence order, however out of order they arrive.
+//
+// Records that arrive early are held until the ones before them are done.
+// Once more than max_buffered bytes are held, Begin makes workers wait
+// before starting another file, as long as the record everyone is waiting
+// for is being worked on (if it is still queued somewhere, workers have to
+// keep going to get to it).
+class OrderedOutput final : public RecordSink {
+  public:
+    explicit OrderedOutput(size_t max_buffered);
+    ~OrderedOutput() override;
+
+    void Begin(uint64_t seq) override;
+    void Add(uint64_t seq, std::string_view key,
+             std::string_view data) override;
+    void Finish() override;
+
+  private:
+    const size_t max_buffered_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    uint64_t next_ = 0;
+    std::map<uint64_t, std::string> held_;
+    size_t held_bytes_ = 0;
+    std::set<uint64_t> active_;
+    std::string out_;
+};
+
+// Writes records sorted by key (and then by contents), whatever order they
+// come in. Once more than about max_buffered bytes are held, they are sorted
+// and written to a temporary file in $TMPDIR as one run, and Finish() merges
+// the runs. Runs are merged into bigger ones as they pile up, so that only a
+// few dozen are open at once, and the buffers for merging them come out of
+// max_buffered too.
+class SortedOutput final : public RecordSink {
+  public:
+    explicit SortedOutput(size_t max_buffered);
+    ~SortedOutput() override;
+
+    void Begin(uint64_t seq) override {}
+    void Add(uint64_t seq, std::string_view key,
+             std::string_view data) override;
+    void Finish() override;
+
+  private:
+    struct Record {
+        size_t offset;
+        uint32_t key_len;
+        uint32_t data_len;
+    };
+
+    std::string_view Key(const Record& r) const;
+    std::string_view Data(const Record& r) const;
+    // Requires mu_.
+    void Sort();
+    void Spill();
+    // Replaces the last count runs with one run holding all of them.
+    void MergeLast(size_t count);
+
+    const size_t max_buffered_;
+    // The stdio buffer for each run being written or merged.
+    const size_t run_buffer_size_;
+
+    std::mutex mu_;
+    // Keys and contents of the held records, back to back.
+    std::string arena_;
+    std::vector<Record> records_;
+    struct Run {
+        int fd;
+        // How many times its records were merged; runs are only merged with
+        // others of the same level until Finish().
+        int level;
+    };
+    std::vector<Run> runs_;
+};
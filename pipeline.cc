@@ -0,0 +1,245 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "pipeline.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cache.h"
+#include "common.h"
+#include "file.h"
+#include "numa.h"
+#include "platform.h"
+#include "throttle.h"
+#include "utils.h"
+
+namespace {
+struct Chunk {
+    std::unique_ptr<char[]> data;
+    size_t len = 0;
+};
+
+// A bounded queue of chunks of one file, filled by an I/O thread and drained
+// by the worker hashing the file. Chunks are recycled, so a file never has
+// more than depth of them allocated.
+class ChunkQueue {
+  public:
+    ChunkQueue(size_t chunk_size, size_t depth);
+
+    // Producer side. Acquire returns an empty chunk if the consumer is gone.
+    Chunk Acquire();
+    void Push(Chunk chunk);
+    void Close();
+
+    // Consumer side. Pop returns an empty chunk at the end of the file.
+    Chunk Pop();
+    void Release(Chunk chunk);
+    void Cancel();
+
+  private:
+    const size_t chunk_size_;
+    const size_t depth_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<Chunk> full_;
+    std::vector<Chunk> free_;
+    size_t allocated_ = 0;
+    bool closed_ = false;
+    bool cancelled_ = false;
+};
+
+ChunkQueue::ChunkQueue(size_t chunk_size, size_t depth)
+    : chunk_size_(chunk_size), depth_(depth) {}
+
+Chunk ChunkQueue::Acquire() {
+    std::unique_lock<std::mutex> l(mu_);
+    cv_.wait(l, [this]() {
+        return cancelled_ || !free_.empty() || allocated_ < depth_;
+    });
+    if (cancelled_) return {};
+    if (free_.empty()) {
+        ++allocated_;
+        return {.data = std::make_unique<char[]>(chunk_size_)};
+    }
+    Chunk ret = std::move(free_.back());
+    free_.pop_back();
+    return ret;
+}
+
+void ChunkQueue::Push(Chunk chunk) {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        full_.push_back(std::move(chunk));
+    }
+    cv_.notify_all();
+}
+
+void ChunkQueue::Close() {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        closed_ = true;
+    }
+    cv_.notify_all();
+}
+
+Chunk ChunkQueue::Pop() {
+    std::unique_lock<std::mutex> l(mu_);
+    cv_.wait(l, [this]() { return closed_ || !full_.empty(); });
+    if (full_.empty()) return {};
+    Chunk ret = std::move(full_.front());
+    full_.pop_front();
+    return ret;
+}
+
+void ChunkQueue::Release(Chunk chunk) {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        free_.push_back(std::move(chunk));
+    }
+    cv_.notify_all();
+}
+
+void ChunkQueue::Cancel() {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        cancelled_ = true;
+        full_.clear();
+        free_.clear();
+    }
+    cv_.notify_all();
+}
+
+// The worker's end of a ChunkQueue.
+class QueueChunkSource final : public ChunkSource {
+  public:
+    explicit QueueChunkSource(std::shared_ptr<ChunkQueue> queue);
+    ~QueueChunkSource() override;
+    std::span<const char> Next() override;
+
+  private:
+    const std::shared_ptr<ChunkQueue> queue_;
+    Chunk current_;
+};
+
+QueueChunkSource::QueueChunkSource(std::shared_ptr<ChunkQueue> queue)
+    : queue_(std::move(queue)) {}
+
+QueueChunkSource::~QueueChunkSource() { queue_->Cancel(); }
+
+std::span<const char> QueueChunkSource::Next() {
+    if (current_.data) queue_->Release(std::move(current_));
+    current_ = queue_->Pop();
+    return std::span<const char>(current_.data.get(), current_.len);
+}
+}
+
+ReadPipeline::ReadPipeline(FnameIterator* iterator, int io_threads,
+                           size_t max_ready, size_t chunk_size, size_t depth,
+                           bool pin_numa)
+    : iterator_(iterator),
+      num_io_threads_(io_threads),
+      max_ready_(max_ready),
+      chunk_size_(chunk_size),
+      depth_(depth),
+      pin_numa_(pin_numa),
+      running_(io_threads) {}
+
+ReadPipeline::~ReadPipeline() {
+    for (auto& thread : io_threads_) thread.join();
+}
+
+void ReadPipeline::Start() {
+    io_threads_.reserve(num_io_threads_);
+    for (int i = 0; i < num_io_threads_; ++i) {
+        io_threads_.emplace_back(&ReadPipeline::Reader, this, i);
+    }
+}
+
+ReadPipeline::Job ReadPipeline::GetNext() {
+    std::unique_lock<std::mutex> l(mu_);
+    cv_.wait(l, [this]() { return !ready_.empty() || running_ == 0; });
+    if (ready_.empty()) return {};
+    Job ret = std::move(ready_.front());
+    ready_.pop_front();
+    cv_.notify_all();
+    return ret;
+}
+
+void ReadPipeline::Reader(int index) {
+    if (pin_numa_) PinToNumaNode(index);
+    while (true) {
+        FnameEntry entry = iterator_->GetNext();
+        if (entry.path.empty()) break;
+
+        const char* const path = entry.path.c_str();
+        const int fd = open(path, open_flags(path));
+        std::shared_ptr<ChunkQueue> queue;
+        Job job = {.entry = entry, .contents = nullptr};
+        if (fd >= 0) {
+            queue = std::make_shared<ChunkQueue>(chunk_size_, depth_);
+            job.contents =
+                OpenFile::Create(std::make_unique<QueueChunkSource>(queue));
+        }
+
+        {
+            std::unique_lock<std::mutex> l(mu_);
+            cv_.wait(l, [this]() { return ready_.size() < max_ready_; });
+            ready_.push_back(std::move(job));
+        }
+        cv_.notify_all();
+
+        if (fd >= 0) {
+            const Cleanup closer([fd]() { close(fd); });
+            ReadThrottle throttle = ReadThrottle::ForFd(fd);
+            throttle.Open();
+            CacheAdvice cache = CacheAdvice::ForFd(fd);
+            off_t offset = 0;
+            while (true) {
+                Chunk chunk = queue->Acquire();
+                if (!chunk.data) break;
+                const size_t reserved = throttle.Read(offset, chunk_size_);
+                const ssize_t amount = read(fd, chunk.data.get(), chunk_size_);
+                if (amount < 0) DIE("read");
+                throttle.Settle(reserved, amount);
+                if (amount == 0) break;
+                cache.Read(offset, amount);
+                offset += amount;
+                chunk.len = amount;
+                queue->Push(std::move(chunk));
+            }
+            cache.Finish();
+            queue->Close();
+        }
+        iterator_->Finished(entry);
+    }
+
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        --running_;
+    }
+    cv_.notify_all();
+}
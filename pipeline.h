@@ -0,0 +1,71 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "file.h"
+#include "utils.h"
+
+// Splits the work on each file into an I/O stage and a CPU stage. A pool of
+// I/O threads takes files from an FnameIterator, opens them and reads their
+// contents into buffers, while the workers that call GetNext only hash.
+//
+// Memory is bounded: at most max_ready files wait to be picked up by a
+// worker, and each file in flight holds at most depth chunks of chunk_size
+// bytes. With pin_numa, I/O threads are pinned to NUMA nodes in turn.
+class ReadPipeline {
+  public:
+    struct Job {
+        FnameEntry entry;
+        // Streams the file's contents, or null if it could not be opened.
+        std::unique_ptr<OpenFile> contents;
+    };
+
+    ReadPipeline(FnameIterator* iterator, int io_threads, size_t max_ready,
+                 size_t chunk_size, size_t depth, bool pin_numa);
+    ~ReadPipeline();
+
+    void Start();
+
+    // Returns the next file to hash, or a job with an empty path once every
+    // file has been handed out.
+    Job GetNext();
+
+  private:
+    void Reader(int index);
+
+    FnameIterator* const iterator_;
+    const int num_io_threads_;
+    const size_t max_ready_;
+    const size_t chunk_size_;
+    const size_t depth_;
+    const bool pin_numa_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<Job> ready_;
+    int running_;
+
+    std::vector<std::thread> io_threads_;
+};
@@ -15,12 +15,45 @@
 
 #include "platform.h"
 
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <vector>
+
+namespace {
+// cached_bytes by mapping the range and asking mincore about it, which works
+// everywhere but costs a byte of memory for every page.
+off_t mincore_bytes(int fd, off_t offset, off_t len) {
+    if (len <= 0) return 0;
+    const off_t page = sysconf(_SC_PAGESIZE);
+    const off_t start = offset - offset % page;
+    const size_t map_len = offset + len - start;
+    void* const mem = mmap(nullptr, map_len, PROT_READ, MAP_SHARED, fd, start);
+    if (mem == MAP_FAILED) return -1;
+    std::vector<unsigned char> vec((map_len + page - 1) / page);
+#if defined(__linux__)
+    unsigned char* const bits = vec.data();
+#else
+    char* const bits = reinterpret_cast<char*>(vec.data());
+#endif
+    const int ret = mincore(mem, map_len, bits);
+    munmap(mem, map_len);
+    if (ret) return -1;
+    off_t pages = 0;
+    for (const unsigned char v : vec) pages += v & 1;
+    return pages * page;
+}
+}
+
 #if defined(__FreeBSD__)
 
 #include <sys/types.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/extattr.h>
+#include <sys/rtprio.h>
+#include <unistd.h>
 
 int get_attr(const char* path, const char* name,
                  void* value, size_t* size) {
@@ -54,21 +87,50 @@ int remove_attr(const char* path, const char* name) {
     return -1;
 }
 
+int lower_priority() {
+    struct rtprio rtp = {.type = RTP_PRIO_IDLE, .prio = RTP_PRIO_MAX};
+    return rtprio_thread(RTP_SET, 0, &rtp) == 0 ? 0 : -1;
+}
+
+int prefetch_file(const char* path, off_t len) {
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT || errno == EACCES ? 1 : -1;
+    const int ret = posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    close(fd);
+    return ret == 0 ? 0 : -1;
+}
+
+off_t cached_bytes(int fd, off_t offset, off_t len) {
+    return mincore_bytes(fd, offset, len);
+}
+
 int open_flags(const char* path) { return O_RDONLY; }
 
 #elif defined(__linux__)
 
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/ioprio.h>
+#include <sched.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 
+#include <atomic>
+
 #include "common.h"
 
+namespace {
+#if defined(SYS_cachestat)
+constexpr long kSysCachestat = SYS_cachestat;
+#else
+constexpr long kSysCachestat = 451;
+#endif
+}
+
 int get_attr(const char* path, const char* name, void* value, size_t* size) {
-    LOCAL_STRING(propname, "user.%s", name);
-    const int ret = getxattr(path, propname, value, *size);
+    const int ret = getxattr(path, name, value, *size);
     if (ret >= 0) {
         *size = ret;
         return 0;
@@ -81,22 +143,66 @@ int get_attr(const char* path, const char* name, void* value, size_t* size) {
 }
 
 int set_attr(const char* path, const char* name, const void* value, size_t size) {
-    LOCAL_STRING(propname, "user.%s", name);
-    const int ret = setxattr(path, propname, value, size, 0);
+    const int ret = setxattr(path, name, value, size, 0);
     if (ret == 0) return 0;
     if (errno == EACCES) return 1;
     return -1;
 }
 
 int remove_attr(const char* path, const char* name) {
-    LOCAL_STRING(propname, "user.%s", name);
-    const int ret = removexattr(path, propname);
+    const int ret = removexattr(path, name);
     if (ret == 0) return 0;
     if (errno == ENODATA) return 0;
     if (errno == EACCES) return 0;
     return -1;
 }
 
+int lower_priority() {
+    const int ioprio = IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio)) return -1;
+
+    const struct sched_param param = {.sched_priority = 0};
+    if (sched_setscheduler(0, SCHED_IDLE, &param)) return -1;
+    return 0;
+}
+
+int prefetch_file(const char* path, off_t len) {
+    // O_NOATIME only works on our own files; reading ahead does not count as
+    // an access anyway, so nothing is lost without it.
+    int fd = open(path, O_RDONLY | O_NOATIME);
+    if (fd < 0 && errno == EPERM) fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT || errno == EACCES ? 1 : -1;
+    const int ret = posix_fadvise(fd, 0, len, POSIX_FADV_WILLNEED);
+    close(fd);
+    return ret == 0 ? 0 : -1;
+}
+
+off_t cached_bytes(int fd, off_t offset, off_t len) {
+    // cachestat (Linux 6.5) answers from the page cache itself, without
+    // mapping anything. Older kernels fall back to mincore.
+    struct CachestatRange {
+        uint64_t off;
+        uint64_t len;
+    } range = {static_cast<uint64_t>(offset), static_cast<uint64_t>(len)};
+    struct Cachestat {
+        uint64_t nr_cache;
+        uint64_t nr_dirty;
+        uint64_t nr_writeback;
+        uint64_t nr_evicted;
+        uint64_t nr_recently_evicted;
+    } stat;
+    static std::atomic<bool> have_cachestat = true;
+    if (len <= 0) return 0;
+    if (have_cachestat.load(std::memory_order_relaxed)) {
+        if (syscall(kSysCachestat, fd, &range, &stat, 0) == 0) {
+            return stat.nr_cache * sysconf(_SC_PAGESIZE);
+        }
+        if (errno != ENOSYS) return -1;
+        have_cachestat.store(false, std::memory_order_relaxed);
+    }
+    return mincore_bytes(fd, offset, len);
+}
+
 int open_flags(const char* path) {
     const uid_t self = geteuid();
     struct stat buf;
@@ -108,3 +214,19 @@ int open_flags(const char* path) {
 #else
 #  error "Not compiling on a known OS."
 #endif
+
+double cached_fraction(int fd, off_t size, off_t sample) {
+    if (size <= 0) return 1;
+    if (size <= 2 * sample) {
+        const off_t cached = cached_bytes(fd, 0, size);
+        return cached < 0 ? -1 : static_cast<double>(cached) / size;
+    }
+    // Pages are cached whole, so line the tail up with one.
+    const off_t page = sysconf(_SC_PAGESIZE);
+    const off_t tail = (size - sample) / page * page;
+    const off_t head_cached = cached_bytes(fd, 0, sample);
+    const off_t tail_cached = cached_bytes(fd, tail, size - tail);
+    if (head_cached < 0 || tail_cached < 0) return -1;
+    return static_cast<double>(head_cached + tail_cached) /
+           (sample + size - tail);
+}
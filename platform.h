@@ -16,8 +16,18 @@
 #pragma once
 
 #include <stddef.h>
+#include <sys/types.h>
 
-// Get an extended file attribute from path. Stores the size in size.
+// What the name of an attribute in the user's namespace starts with, as
+// passed to the functions below.
+#if defined(__linux__)
+#define ATTR_PREFIX "user."
+#else
+#define ATTR_PREFIX ""
+#endif
+
+// Get an extended file attribute from path. Stores the size in size. name is
+// the full name of the attribute, including ATTR_PREFIX.
 //
 // Returns 0 on succes.
 // Returns <0 if unexpected system error.
@@ -34,6 +44,34 @@ int set_attr(const char* path, const char* name, const void* value, size_t size)
 // Returns 0 on success, >0 on expected error, <0 on unexpected error.
 int remove_attr(const char* path, const char* name);
 
+// Drops the calling thread, and threads it creates from then on, to idle CPU
+// and I/O priority, so that it only uses what nothing else wants.
+//
+// Returns 0 on success, <0 on unexpected system error.
+int lower_priority();
+
+// Asks the kernel to start reading the first len bytes of path into the page
+// cache, without waiting for them.
+//
+// Returns 0 on success, <0 on unexpected system error, >0 on expected error.
+int prefetch_file(const char* path, off_t len);
+
+// Returns how many of the bytes from offset to offset + len of fd are in the
+// page cache, counting whole pages, or <0 on unexpected system error.
+off_t cached_bytes(int fd, off_t offset, off_t len);
+
+// Returns about what fraction of fd, a size byte file, is in the page cache,
+// judging by at most sample bytes at its start and as many at its end, so
+// that big files cost no more to look at than small ones. Returns <0 on
+// unexpected system error.
+double cached_fraction(int fd, off_t size, off_t sample);
+
+// What everything that orders or reads files by whether they are cached
+// passes cached_fraction() as sample, and the fraction at or above which a
+// file counts as cached.
+constexpr off_t kCacheSampleBytes = 4 << 20;
+constexpr double kCachedFraction = 0.9;
+
 // Returns the flags to be used to open files. This can differ by platform
 // depending on what open flags are supported.
 int open_flags(const char* path);
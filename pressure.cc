@@ -0,0 +1,171 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "pressure.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "common.h"
+#include "resources.h"
+#include "tuning.h"
+
+namespace {
+constexpr auto kWindow = std::chrono::seconds(1);
+
+// Returns the total microseconds that some task has stalled on the resource
+// described by path.
+std::optional<uint64_t> ReadStallTotal(const char* path) {
+    FILE* const f = fopen(path, "r");
+    if (!f) return std::nullopt;
+    const Cleanup closer([f]() { fclose(f); });
+
+    unsigned long long total;
+    if (fscanf(f, "some avg10=%*f avg60=%*f avg300=%*f total=%llu",
+               &total) != 1) {
+        return std::nullopt;
+    }
+    return total;
+}
+
+// Returns the percentage of the last elapsed_us microseconds during which
+// path's stall total grew, given its total before them in *last, which this
+// updates.
+std::optional<double> StallPercent(const char* path,
+                                   std::optional<uint64_t>* last,
+                                   double elapsed_us) {
+    const auto total = ReadStallTotal(path);
+    const auto before = *last;
+    *last = total;
+    if (!total.has_value() || !before.has_value()) return std::nullopt;
+    return (*total - *before) * 100 / elapsed_us;
+}
+}
+
+PressureMonitor::PressureMonitor(WorkerGate* gate, int max_workers,
+                                 const PressureThresholds& thresholds)
+    : gate_(gate), max_workers_(max_workers), thresholds_(thresholds) {}
+
+PressureMonitor::~PressureMonitor() { Stop(); }
+
+void PressureMonitor::Start() {
+    thread_ = std::thread(&PressureMonitor::Run, this);
+}
+
+void PressureMonitor::Stop() {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+std::chrono::duration<double> PressureMonitor::throttled() const {
+    const std::lock_guard<std::mutex> l(mu_);
+    return throttled_;
+}
+
+std::chrono::duration<double> PressureMonitor::paused() const {
+    const std::lock_guard<std::mutex> l(mu_);
+    return paused_;
+}
+
+void PressureMonitor::Run() {
+    struct Resource {
+        const char* path;
+        double threshold;
+        // The same file for our own cgroup, if we are in one of our own.
+        std::optional<std::string> own_path;
+        std::optional<uint64_t> last_total;
+        std::optional<uint64_t> last_own_total;
+        // Without own_path: how much of the system's pressure we add
+        // ourselves with every worker running, as learned from pausing.
+        double own = 0;
+        // And the pressure last seen with every worker running.
+        double full = 0;
+    };
+    std::array<Resource, 3> resources = {{
+        {"/proc/pressure/io", thresholds_.io, OwnCgroupFile("io.pressure")},
+        {"/proc/pressure/cpu", thresholds_.cpu,
+         OwnCgroupFile("cpu.pressure")},
+        {"/proc/pressure/memory", thresholds_.memory,
+         OwnCgroupFile("memory.pressure")},
+    }};
+    for (auto& resource : resources) {
+        resource.last_total = ReadStallTotal(resource.path);
+        if (resource.own_path.has_value()) {
+            resource.last_own_total =
+                ReadStallTotal(resource.own_path->c_str());
+        }
+    }
+
+    int cap = max_workers_;
+    auto last = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> l(mu_);
+    while (!cv_.wait_for(l, kWindow, [this]() { return stopped_; })) {
+        const auto now = std::chrono::steady_clock::now();
+        const auto elapsed = now - last;
+        last = now;
+        if (cap < max_workers_) throttled_ += elapsed;
+        if (cap == 0) paused_ += elapsed;
+
+        const double elapsed_us =
+            std::chrono::duration<double, std::micro>(elapsed).count();
+        bool high = false;
+        bool low = true;
+        for (auto& resource : resources) {
+            const auto percent =
+                StallPercent(resource.path, &resource.last_total, elapsed_us);
+            double own = 0;
+            if (resource.own_path.has_value()) {
+                own = StallPercent(resource.own_path->c_str(),
+                                   &resource.last_own_total, elapsed_us)
+                          .value_or(0);
+            }
+            if (!percent.has_value()) continue;
+            if (!resource.own_path.has_value()) {
+                // While every worker is paused, all of the pressure is other
+                // tasks', so the rest of what there was with all of them
+                // running was ours.
+                if (cap == 0) {
+                    resource.own = std::max(resource.full - *percent, 0.0);
+                }
+                if (cap == max_workers_) resource.full = *percent;
+                own = resource.own;
+            }
+            // Only other tasks' stalls count: we are what we would slow.
+            const double others = *percent - own;
+            high |= others > resource.threshold;
+            low &= others < resource.threshold / 2;
+        }
+
+        int next = cap;
+        if (high) next = cap / 2;
+        if (low) next = std::min(std::max(cap * 2, 1), max_workers_);
+        if (next == cap) continue;
+        cap = next;
+        gate_->SetCap(cap);
+    }
+}
@@ -0,0 +1,73 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "tuning.h"
+
+// Percentages of wall time during which some task was stalled on each
+// resource, as reported by pressure stall information (/proc/pressure).
+struct PressureThresholds {
+    double io = 10;
+    double cpu = 50;
+    double memory = 10;
+};
+
+// Watches system pressure and caps the workers of a WorkerGate while any of
+// it is above its threshold: the cap halves every second the pressure stays
+// high, down to pausing every worker, and doubles back up once pressure has
+// fallen to half the thresholds. Does nothing where /proc/pressure is
+// missing.
+//
+// Only other tasks' stalls count, or the workers' own would throttle them on
+// an idle system. Those in our own cgroup's pressure files are taken to be
+// ours. Without a cgroup of our own, what the system's pressure falls by
+// once every worker is paused is taken to be ours from then on, so the first
+// time the workers themselves push pressure over a threshold they are
+// paused until that is learned.
+class PressureMonitor {
+  public:
+    PressureMonitor(WorkerGate* gate, int max_workers,
+                    const PressureThresholds& thresholds);
+    ~PressureMonitor();
+
+    void Start();
+    void Stop();
+
+    // Time during which fewer than all the workers were allowed to run, and
+    // during which none were.
+    std::chrono::duration<double> throttled() const;
+    std::chrono::duration<double> paused() const;
+
+  private:
+    void Run();
+
+    WorkerGate* const gate_;
+    const int max_workers_;
+    const PressureThresholds thresholds_;
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+    bool stopped_ = false;
+    std::chrono::steady_clock::duration throttled_{};
+    std::chrono::steady_clock::duration paused_{};
+
+    std::thread thread_;
+};
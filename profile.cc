@@ -0,0 +1,104 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "profile.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <string_view>
+
+#include "common.h"
+
+namespace {
+// Returns the directory profiles live in, or an empty string if there is no
+// way to tell where it should be.
+std::string ProfileDir() {
+    const char* const cache = getenv("XDG_CACHE_HOME");
+    if (cache && *cache) return std::string(cache) + "/hasher";
+    const char* const home = getenv("HOME");
+    if (home && *home) return std::string(home) + "/.cache/hasher";
+    return "";
+}
+
+bool MakeDir(const std::string& path) {
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+}  // namespace
+
+Profile LoadProfile(std::string_view name) {
+    Profile ret;
+    const std::string dir = ProfileDir();
+    if (dir.empty()) return ret;
+
+    const std::string path = dir + "/" + std::string(name);
+    FILE* const f = fopen(path.c_str(), "r");
+    if (!f) return ret;
+    const Cleanup closer([f]() { fclose(f); });
+
+    char* line = nullptr;
+    size_t cap = 0;
+    const Cleanup freer([&line]() { free(line); });
+    ssize_t len;
+    while ((len = getline(&line, &cap, f)) > 0) {
+        std::string_view entry(line, len);
+        if (entry.back() == '\n') entry.remove_suffix(1);
+        const size_t tab = entry.find('\t');
+        if (tab == std::string_view::npos) continue;
+        ret[std::string(entry.substr(0, tab))] =
+            std::string(entry.substr(tab + 1));
+    }
+    return ret;
+}
+
+std::string SaveProfile(std::string_view name, const Profile& profile) {
+    const std::string dir = ProfileDir();
+    if (dir.empty()) {
+        WriteLocked(stderr, "Not saving %.*s profile: no home directory\n",
+                    static_cast<int>(name.size()), name.data());
+        return "";
+    }
+    // Make ~/.cache too, if need be.
+    const size_t slash = dir.rfind('/');
+    if (!MakeDir(dir.substr(0, slash)) || !MakeDir(dir)) {
+        WriteLocked(stderr, "Not saving profile: mkdir %s: %s\n", dir.c_str(),
+                    strerror(errno));
+        return "";
+    }
+
+    // Write it next to the old one and rename it over, so that a run that
+    // starts meanwhile sees one or the other.
+    const std::string path = dir + "/" + std::string(name);
+    const std::string temp = path + ".new";
+    FILE* const f = fopen(temp.c_str(), "w");
+    if (!f) {
+        WriteLocked(stderr, "Not saving profile: %s: %s\n", temp.c_str(),
+                    strerror(errno));
+        return "";
+    }
+    for (const auto& [key, value] : profile) {
+        fprintf(f, "%s\t%s\n", key.c_str(), value.c_str());
+    }
+    if (fclose(f) || rename(temp.c_str(), path.c_str())) {
+        WriteLocked(stderr, "Not saving profile: %s: %s\n", path.c_str(),
+                    strerror(errno));
+        return "";
+    }
+    return path;
+}
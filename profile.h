@@ -0,0 +1,32 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <string_view>
+
+// Small files under $XDG_CACHE_HOME/hasher (or ~/.cache/hasher) that record
+// what benchmarks found, so that later runs can use it. Each line of a
+// profile is a key, a tab, and a value.
+using Profile = std::map<std::string, std::string>;
+
+// Returns the profile called name, which is empty if it has not been saved.
+Profile LoadProfile(std::string_view name);
+
+// Replaces the profile called name. Returns where it was saved, or an empty
+// string (after saying why on stderr) if it could not be.
+std::string SaveProfile(std::string_view name, const Profile& profile);
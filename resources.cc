@@ -0,0 +1,217 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "resources.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+#if defined(__linux__)
+
+#include <sched.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+
+namespace {
+constexpr char kCgroupRoot[] = "/sys/fs/cgroup";
+
+int CountAffinity() {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set)) return 0;
+    return CPU_COUNT(&set);
+}
+
+// Returns our cgroup v2 path relative to kCgroupRoot, eg "/kubepods/pod1".
+std::optional<std::string> CgroupPath() {
+    FILE* const f = fopen("/proc/self/cgroup", "r");
+    if (!f) return std::nullopt;
+    const Cleanup closer([f]() { fclose(f); });
+
+    char* line = nullptr;
+    size_t cap = 0;
+    const Cleanup freer([&line]() { free(line); });
+    while (getline(&line, &cap, f) > 0) {
+        if (strncmp(line, "0::", 3)) continue;
+        std::string ret(line + 3);
+        while (!ret.empty() && ret.back() == '\n') ret.pop_back();
+        if (ret == "/") ret.clear();
+        return ret;
+    }
+    return std::nullopt;
+}
+
+// Calls fn with each line of the cgroup file name in cgroup.
+template <typename Fn>
+bool ForEachLine(const std::string& cgroup, const char* name, const Fn& fn) {
+    const std::string path = std::string(kCgroupRoot) + cgroup + "/" + name;
+    FILE* const f = fopen(path.c_str(), "r");
+    if (!f) return false;
+    const Cleanup closer([f]() { fclose(f); });
+
+    char* line = nullptr;
+    size_t cap = 0;
+    const Cleanup freer([&line]() { free(line); });
+    while (getline(&line, &cap, f) > 0) fn(line);
+    return true;
+}
+
+std::optional<double> CpuQuota(std::string cgroup) {
+    std::optional<double> ret;
+    // Every ancestor's cpu.max applies to us, not only our own.
+    while (true) {
+        // "max 100000" means no quota, which sscanf rejects.
+        ForEachLine(cgroup, "cpu.max", [&ret](const char* line) {
+            unsigned long long quota, period;
+            if (sscanf(line, "%llu %llu", &quota, &period) != 2) return;
+            if (period == 0) return;
+            const double cpus = static_cast<double>(quota) / period;
+            ret = std::min(ret.value_or(cpus), cpus);
+        });
+        if (cgroup.empty()) break;
+        cgroup.resize(cgroup.rfind('/'));
+    }
+    return ret;
+}
+
+std::optional<int> IoWeight(const std::string& cgroup) {
+    std::optional<int> ret;
+    ForEachLine(cgroup, "io.weight", [&ret](const char* line) {
+        int weight;
+        if (sscanf(line, "default %d", &weight) == 1) ret = weight;
+    });
+    return ret;
+}
+
+std::vector<IoMax> ReadIoMax(const std::string& cgroup) {
+    std::vector<IoMax> ret;
+    // Lines look like "8:16 rbps=2097152 wbps=max riops=max wiops=120".
+    ForEachLine(cgroup, "io.max", [&ret](char* line) {
+        char* save = nullptr;
+        const char* const device = strtok_r(line, " \n", &save);
+        unsigned maj, min;
+        if (!device || sscanf(device, "%u:%u", &maj, &min) != 2) return;
+
+        IoMax entry = {
+            .dev = makedev(maj, min), .rbps = std::nullopt,
+            .riops = std::nullopt,
+        };
+        while (const char* const field = strtok_r(nullptr, " \n", &save)) {
+            unsigned long long value;
+            if (sscanf(field, "rbps=%llu", &value) == 1) entry.rbps = value;
+            if (sscanf(field, "riops=%llu", &value) == 1) entry.riops = value;
+        }
+        ret.push_back(entry);
+    });
+    return ret;
+}
+
+ResourceLimits ReadLimits() {
+    ResourceLimits ret = {
+        .online_cpus = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN)),
+        .affinity_cpus = CountAffinity(),
+        .cpu_quota = std::nullopt,
+        .io_weight = std::nullopt,
+        .io_max = {},
+    };
+    if (ret.affinity_cpus <= 0) ret.affinity_cpus = ret.online_cpus;
+
+    const auto cgroup = CgroupPath();
+    if (!cgroup.has_value()) return ret;
+    ret.cpu_quota = CpuQuota(*cgroup);
+    ret.io_weight = IoWeight(*cgroup);
+    ret.io_max = ReadIoMax(*cgroup);
+    return ret;
+}
+}
+
+std::optional<std::string> OwnCgroupFile(const char* name) {
+    const auto cgroup = CgroupPath();
+    if (!cgroup.has_value() || cgroup->empty()) return std::nullopt;
+    std::string ret = std::string(kCgroupRoot) + *cgroup + "/" + name;
+    if (access(ret.c_str(), R_OK)) return std::nullopt;
+    return ret;
+}
+
+#else
+
+namespace {
+ResourceLimits ReadLimits() {
+    const int online = sysconf(_SC_NPROCESSORS_ONLN);
+    return {
+        .online_cpus = online,
+        .affinity_cpus = online,
+        .cpu_quota = std::nullopt,
+        .io_weight = std::nullopt,
+        .io_max = {},
+    };
+}
+}
+
+std::optional<std::string> OwnCgroupFile(const char* name) {
+    return std::nullopt;
+}
+
+#endif
+
+int ResourceLimits::DefaultThreads() const {
+    int ret = affinity_cpus;
+    if (cpu_quota.has_value()) {
+        ret = std::min<int>(ret, ceil(*cpu_quota));
+    }
+    return std::max(ret, 1);
+}
+
+bool ResourceLimits::ReadThrottled(dev_t dev) const {
+    for (const auto& entry : io_max) {
+        if (entry.dev != dev) continue;
+        return entry.rbps.has_value() || entry.riops.has_value();
+    }
+    return false;
+}
+
+const ResourceLimits& GetResourceLimits() {
+    static const ResourceLimits limits = ReadLimits();
+    return limits;
+}
+
+void PrintResourceLimits(FILE* stream) {
+    const auto& limits = GetResourceLimits();
+    fprintf(stream, "CPUs online:      %d\n", limits.online_cpus);
+    fprintf(stream, "CPUs in affinity: %d\n", limits.affinity_cpus);
+    if (limits.cpu_quota.has_value()) {
+        fprintf(stream, "cgroup cpu.max:   %.2f CPUs\n", *limits.cpu_quota);
+    }
+    if (limits.io_weight.has_value()) {
+        fprintf(stream, "cgroup io.weight: %d\n", *limits.io_weight);
+    }
+    for (const auto& entry : limits.io_max) {
+        fprintf(stream, "cgroup io.max:    %u:%u",
+                major(entry.dev), minor(entry.dev));
+        if (entry.rbps) fprintf(stream, " rbps=%llu",
+                                static_cast<unsigned long long>(*entry.rbps));
+        if (entry.riops) fprintf(stream, " riops=%llu",
+                                 static_cast<unsigned long long>(*entry.riops));
+        fprintf(stream, "\n");
+    }
+    fprintf(stream, "Default threads:  %d\n", limits.DefaultThreads());
+}
@@ -0,0 +1,60 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <optional>
+#include <string>
+#include <vector>
+
+// A cgroup io.max entry for one device. Unset fields are unlimited.
+struct IoMax {
+    dev_t dev;
+    std::optional<uint64_t> rbps;
+    std::optional<uint64_t> riops;
+};
+
+// How much of the machine this process is allowed to use.
+struct ResourceLimits {
+    // CPUs the system has online.
+    int online_cpus;
+    // CPUs in our affinity mask (our cpuset, in a container).
+    int affinity_cpus;
+    // The tightest cgroup cpu.max quota along our cgroup's ancestry, in CPUs.
+    std::optional<double> cpu_quota;
+    // Our cgroup's io.weight default, if the io controller is enabled.
+    std::optional<int> io_weight;
+    std::vector<IoMax> io_max;
+
+    // The number of workers that keeps every CPU we may use busy.
+    int DefaultThreads() const;
+    // Whether io.max limits how fast we may read from the disk dev.
+    bool ReadThrottled(dev_t dev) const;
+};
+
+// Reads the limits once; later calls return the same object.
+const ResourceLimits& GetResourceLimits();
+
+// Describes the limits on stream, one per line.
+void PrintResourceLimits(FILE* stream);
+
+// Returns the path of the file name (eg "io.pressure") in our cgroup v2
+// cgroup, or nullopt if there is none or we are in the root cgroup, whose
+// files would describe the whole system.
+std::optional<std::string> OwnCgroupFile(const char* name);
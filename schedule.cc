@@ -0,0 +1,518 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "schedule.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "device.h"
+#include "numa.h"
+#include "platform.h"
+#include "resources.h"
+#include "utils.h"
+
+namespace {
+// Fills in size and dev if the iterator that produced entry did not.
+void StatEntry(FnameEntry* entry) {
+    if (entry->size >= 0) return;
+    struct stat sb;
+    if (stat(entry->path.c_str(), &sb)) {
+        // Let the worker report the error when it tries to use the file.
+        entry->size = 0;
+        return;
+    }
+    entry->size = sb.st_size;
+    entry->dev = sb.st_dev;
+}
+
+class LargestFirstIterator final : public FnameIterator {
+  public:
+    LargestFirstIterator(std::unique_ptr<FnameIterator> inner,
+                         size_t lookahead);
+    ~LargestFirstIterator() override;
+
+    FnameEntry GetNext() override;
+    void Start() override;
+    void Finished(const FnameEntry& entry) override;
+
+  private:
+    static bool Smaller(const FnameEntry& a, const FnameEntry& b);
+
+    const std::unique_ptr<FnameIterator> inner_;
+    const size_t lookahead_;
+
+    std::mutex mu_;
+    std::vector<FnameEntry> heap_;
+    bool exhausted_ = false;
+};
+
+LargestFirstIterator::LargestFirstIterator(
+        std::unique_ptr<FnameIterator> inner, size_t lookahead)
+    : inner_(std::move(inner)), lookahead_(std::max<size_t>(lookahead, 1)) {
+    heap_.reserve(lookahead_);
+}
+
+LargestFirstIterator::~LargestFirstIterator() = default;
+
+FnameEntry LargestFirstIterator::GetNext() {
+    std::unique_lock<std::mutex> l(mu_);
+    while (!exhausted_ && heap_.size() < lookahead_) {
+        // stat() can be slow (on NFS, or a cold disk), so workers that need
+        // to fill the heap all stat at once, and only lock to add to it.
+        l.unlock();
+        FnameEntry next = inner_->GetNext();
+        if (!next.path.empty()) StatEntry(&next);
+        l.lock();
+        if (next.path.empty()) {
+            exhausted_ = true;
+            break;
+        }
+        heap_.push_back(std::move(next));
+        std::push_heap(heap_.begin(), heap_.end(), &Smaller);
+    }
+    if (heap_.empty()) return {};
+
+    std::pop_heap(heap_.begin(), heap_.end(), &Smaller);
+    FnameEntry ret = std::move(heap_.back());
+    heap_.pop_back();
+    return ret;
+}
+
+void LargestFirstIterator::Start() { inner_->Start(); }
+
+void LargestFirstIterator::Finished(const FnameEntry& entry) {
+    inner_->Finished(entry);
+}
+
+// static
+bool LargestFirstIterator::Smaller(const FnameEntry& a, const FnameEntry& b) {
+    return a.size < b.size;
+}
+
+class CachedFirstIterator final : public FnameIterator {
+  public:
+    CachedFirstIterator(std::unique_ptr<FnameIterator> inner,
+                        size_t lookahead);
+    ~CachedFirstIterator() override;
+
+    FnameEntry GetNext() override;
+    void Start() override;
+    void Finished(const FnameEntry& entry) override;
+
+  private:
+    static bool IsCached(const FnameEntry& entry);
+
+    const std::unique_ptr<FnameIterator> inner_;
+    const size_t lookahead_;
+
+    std::mutex mu_;
+    std::deque<FnameEntry> cached_;
+    std::deque<FnameEntry> cold_;
+    bool exhausted_ = false;
+};
+
+CachedFirstIterator::CachedFirstIterator(std::unique_ptr<FnameIterator> inner,
+                                         size_t lookahead)
+    : inner_(std::move(inner)), lookahead_(std::max<size_t>(lookahead, 1)) {}
+
+CachedFirstIterator::~CachedFirstIterator() = default;
+
+FnameEntry CachedFirstIterator::GetNext() {
+    std::unique_lock<std::mutex> l(mu_);
+    while (!exhausted_ && cached_.empty() &&
+           cold_.size() < lookahead_) {
+        // Looking at the file takes system calls, so other workers can take
+        // what is already sorted meanwhile.
+        l.unlock();
+        FnameEntry next = inner_->GetNext();
+        bool cached = false;
+        if (!next.path.empty()) {
+            StatEntry(&next);
+            cached = IsCached(next);
+        }
+        l.lock();
+        if (next.path.empty()) {
+            exhausted_ = true;
+            break;
+        }
+        (cached ? cached_ : cold_).push_back(std::move(next));
+    }
+
+    for (auto* queue : {&cached_, &cold_}) {
+        if (queue->empty()) continue;
+        FnameEntry ret = std::move(queue->front());
+        queue->pop_front();
+        return ret;
+    }
+    return {};
+}
+
+void CachedFirstIterator::Start() { inner_->Start(); }
+
+void CachedFirstIterator::Finished(const FnameEntry& entry) {
+    inner_->Finished(entry);
+}
+
+// static
+bool CachedFirstIterator::IsCached(const FnameEntry& entry) {
+    if (entry.size <= 0) return true;
+    // Opening a file does not count as accessing it, so no O_NOATIME needed.
+    const int fd = open(entry.path.c_str(), O_RDONLY);
+    // Let the worker report the error when it tries to use the file.
+    if (fd < 0) return true;
+    const double cached = cached_fraction(fd, entry.size, kCacheSampleBytes);
+    close(fd);
+    return cached >= kCachedFraction;
+}
+
+class NumaAffineIterator final : public FnameIterator {
+  public:
+    NumaAffineIterator(std::unique_ptr<FnameIterator> inner,
+                       size_t max_pending);
+    ~NumaAffineIterator() override;
+
+    FnameEntry GetNext() override;
+    void Start() override;
+    void Finished(const FnameEntry& entry) override;
+
+  private:
+    // Returns the node whose threads should handle files on dev, or -1 if
+    // any thread will do. Requires mu_.
+    int NodeOf(dev_t dev);
+
+    const std::unique_ptr<FnameIterator> inner_;
+    const size_t max_pending_;
+
+    std::mutex mu_;
+    std::vector<std::deque<FnameEntry>> pending_;
+    std::unordered_map<dev_t, int> nodes_;
+};
+
+NumaAffineIterator::NumaAffineIterator(std::unique_ptr<FnameIterator> inner,
+                                       size_t max_pending)
+    : inner_(std::move(inner)),
+      max_pending_(max_pending),
+      pending_(NumaNodes().size()) {}
+
+NumaAffineIterator::~NumaAffineIterator() = default;
+
+FnameEntry NumaAffineIterator::GetNext() {
+    const int mine = CurrentNumaNode();
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        if (mine >= 0 && !pending_[mine].empty()) {
+            FnameEntry ret = std::move(pending_[mine].front());
+            pending_[mine].pop_front();
+            return ret;
+        }
+    }
+
+    while (true) {
+        FnameEntry next = inner_->GetNext();
+        StatEntry(&next);
+
+        const std::lock_guard<std::mutex> l(mu_);
+        if (next.path.empty()) {
+            // Nothing new is coming, so help out the other nodes.
+            for (auto& pending : pending_) {
+                if (pending.empty()) continue;
+                FnameEntry ret = std::move(pending.front());
+                pending.pop_front();
+                return ret;
+            }
+            return {};
+        }
+
+        const int node = NodeOf(next.dev);
+        if (mine < 0 || node < 0 || node == mine) return next;
+        if (pending_[node].size() >= max_pending_) return next;
+        pending_[node].push_back(std::move(next));
+    }
+}
+
+void NumaAffineIterator::Start() { inner_->Start(); }
+
+void NumaAffineIterator::Finished(const FnameEntry& entry) {
+    inner_->Finished(entry);
+}
+
+int NumaAffineIterator::NodeOf(dev_t dev) {
+    const auto it = nodes_.find(dev);
+    if (it != nodes_.end()) return it->second;
+
+    int node = -1;
+    const auto info = GetDeviceInfo(dev);
+    if (info.has_value() && info->numa_node >= 0 &&
+        info->numa_node < NumaNodes().size() &&
+        !NumaNodes()[info->numa_node].empty()) {
+        node = info->numa_node;
+    }
+    nodes_.emplace(dev, node);
+    return node;
+}
+
+class PrefetchingIterator final : public FnameIterator {
+  public:
+    PrefetchingIterator(std::unique_ptr<FnameIterator> inner, size_t budget,
+                        size_t prefetch_bytes);
+    ~PrefetchingIterator() override;
+
+    FnameEntry GetNext() override;
+    void Start() override;
+    void Finished(const FnameEntry& entry) override;
+
+  private:
+    // Even empty files cost a queue slot, so count them as this much.
+    static constexpr size_t kMinCost = 4096;
+
+    size_t CostOf(const FnameEntry& entry) const;
+    void Run();
+
+    const std::unique_ptr<FnameIterator> inner_;
+    const size_t budget_;
+    const size_t prefetch_bytes_;
+
+    std::mutex mu_;
+    std::condition_variable ready_;
+    std::condition_variable room_;
+    std::deque<FnameEntry> queue_;
+    // The cost of the entries prefetched and not yet Finished: those in
+    // queue_, and those that wrappers outside us or workers hold.
+    size_t outstanding_ = 0;
+    bool exhausted_ = false;
+    bool stopping_ = false;
+    std::thread thread_;
+};
+
+PrefetchingIterator::PrefetchingIterator(std::unique_ptr<FnameIterator> inner,
+                                         size_t budget, size_t prefetch_bytes)
+    : inner_(std::move(inner)),
+      budget_(std::max({budget, prefetch_bytes, kMinCost})),
+      prefetch_bytes_(prefetch_bytes) {}
+
+PrefetchingIterator::~PrefetchingIterator() {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        stopping_ = true;
+    }
+    room_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+FnameEntry PrefetchingIterator::GetNext() {
+    std::unique_lock<std::mutex> l(mu_);
+    ready_.wait(l, [this]() { return !queue_.empty() || exhausted_; });
+    if (queue_.empty()) return {};
+
+    FnameEntry ret = std::move(queue_.front());
+    queue_.pop_front();
+    return ret;
+}
+
+void PrefetchingIterator::Start() {
+    inner_->Start();
+    thread_ = std::thread([this]() { Run(); });
+}
+
+void PrefetchingIterator::Finished(const FnameEntry& entry) {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        outstanding_ -= CostOf(entry);
+    }
+    room_.notify_one();
+    inner_->Finished(entry);
+}
+
+size_t PrefetchingIterator::CostOf(const FnameEntry& entry) const {
+    return std::max(std::min<size_t>(entry.size, prefetch_bytes_), kMinCost);
+}
+
+void PrefetchingIterator::Run() {
+    while (true) {
+        FnameEntry next = inner_->GetNext();
+        if (next.path.empty()) break;
+        StatEntry(&next);
+        const size_t cost = CostOf(next);
+        {
+            std::unique_lock<std::mutex> l(mu_);
+            room_.wait(l, [&]() {
+                return stopping_ || outstanding_ + cost <= budget_;
+            });
+            if (stopping_) return;
+            outstanding_ += cost;
+        }
+
+        // Files that can not be prefetched are still handed out; the worker
+        // reports whatever is wrong with them.
+        if (next.size > 0) prefetch_file(next.path.c_str(), cost);
+
+        const std::lock_guard<std::mutex> l(mu_);
+        queue_.push_back(std::move(next));
+        ready_.notify_one();
+    }
+    const std::lock_guard<std::mutex> l(mu_);
+    exhausted_ = true;
+    ready_.notify_all();
+}
+
+class DeviceLimitedIterator final : public FnameIterator {
+  public:
+    DeviceLimitedIterator(std::unique_ptr<FnameIterator> inner,
+                          size_t max_pending);
+    ~DeviceLimitedIterator() override;
+
+    FnameEntry GetNext() override;
+    void Start() override;
+    void Finished(const FnameEntry& entry) override;
+
+  private:
+    struct Device {
+        int limit;
+        int in_flight = 0;
+        std::deque<FnameEntry> pending;
+    };
+
+    static int LimitFor(dev_t dev);
+    Device& Lookup(dev_t dev);
+
+    const std::unique_ptr<FnameIterator> inner_;
+    const size_t max_pending_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::unordered_map<dev_t, Device> devices_;
+    size_t num_pending_ = 0;
+    bool exhausted_ = false;
+};
+
+DeviceLimitedIterator::DeviceLimitedIterator(
+        std::unique_ptr<FnameIterator> inner, size_t max_pending)
+    : inner_(std::move(inner)), max_pending_(max_pending) {}
+
+DeviceLimitedIterator::~DeviceLimitedIterator() = default;
+
+FnameEntry DeviceLimitedIterator::GetNext() {
+    std::unique_lock<std::mutex> l(mu_);
+    while (true) {
+        for (auto& [dev, device] : devices_) {
+            if (device.pending.empty()) continue;
+            if (device.in_flight >= device.limit) continue;
+            FnameEntry ret = std::move(device.pending.front());
+            device.pending.pop_front();
+            --num_pending_;
+            ++device.in_flight;
+            return ret;
+        }
+
+        if (!exhausted_ && num_pending_ < max_pending_) {
+            l.unlock();
+            FnameEntry next = inner_->GetNext();
+            StatEntry(&next);
+            l.lock();
+
+            if (next.path.empty()) {
+                exhausted_ = true;
+                cv_.notify_all();
+                continue;
+            }
+            Device& device = Lookup(next.dev);
+            if (device.in_flight < device.limit) {
+                ++device.in_flight;
+                return next;
+            }
+            device.pending.push_back(std::move(next));
+            ++num_pending_;
+            continue;
+        }
+
+        if (exhausted_ && num_pending_ == 0) return {};
+        cv_.wait(l);
+    }
+}
+
+void DeviceLimitedIterator::Start() { inner_->Start(); }
+
+void DeviceLimitedIterator::Finished(const FnameEntry& entry) {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        --Lookup(entry.dev).in_flight;
+    }
+    cv_.notify_all();
+    inner_->Finished(entry);
+}
+
+// static
+int DeviceLimitedIterator::LimitFor(dev_t dev) {
+    const auto info = GetDeviceInfo(dev);
+    if (!info.has_value()) return std::numeric_limits<int>::max();
+    if (info->rotational) return 1;
+    // The throttle, not the queue, decides how fast a throttled disk goes.
+    if (GetResourceLimits().ReadThrottled(info->disk)) return 1;
+    return info->queue_depth;
+}
+
+DeviceLimitedIterator::Device& DeviceLimitedIterator::Lookup(dev_t dev) {
+    auto it = devices_.find(dev);
+    if (it == devices_.end()) {
+        const Device device = {
+            .limit = LimitFor(dev), .in_flight = 0, .pending = {},
+        };
+        it = devices_.emplace(dev, device).first;
+    }
+    return it->second;
+}
+}
+
+std::unique_ptr<FnameIterator> LargestFirst(
+        std::unique_ptr<FnameIterator> inner, size_t lookahead) {
+    return std::make_unique<LargestFirstIterator>(std::move(inner), lookahead);
+}
+
+std::unique_ptr<FnameIterator> CachedFirst(
+        std::unique_ptr<FnameIterator> inner, size_t lookahead) {
+    return std::make_unique<CachedFirstIterator>(std::move(inner), lookahead);
+}
+
+std::unique_ptr<FnameIterator> DeviceLimited(
+        std::unique_ptr<FnameIterator> inner, size_t max_pending) {
+    return std::make_unique<DeviceLimitedIterator>(std::move(inner),
+                                                   max_pending);
+}
+
+std::unique_ptr<FnameIterator> Prefetching(
+        std::unique_ptr<FnameIterator> inner, size_t budget,
+        size_t prefetch_bytes) {
+    return std::make_unique<PrefetchingIterator>(std::move(inner), budget,
+                                                 prefetch_bytes);
+}
+
+std::unique_ptr<FnameIterator> NumaAffine(
+        std::unique_ptr<FnameIterator> inner, size_t max_pending) {
+    return std::make_unique<NumaAffineIterator>(std::move(inner),
+                                                max_pending);
+}
@@ -0,0 +1,63 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stddef.h>
+
+#include <memory>
+
+#include "utils.h"
+
+// Wraps inner so that files are handed out largest first. Up to lookahead
+// entries are buffered, so this approximates longest-processing-time-first
+// scheduling without reading the whole tree into memory.
+std::unique_ptr<FnameIterator> LargestFirst(
+        std::unique_ptr<FnameIterator> inner, size_t lookahead);
+
+// Wraps inner so that, of the next lookahead entries, files that are already
+// (almost) entirely in the page cache are handed out before the ones that
+// have to be read from disk. Only the first and last few MiB of each file
+// are looked at. Hashing those first finishes them at memory
+// speed, before reading the cold files pushes them out of the cache.
+std::unique_ptr<FnameIterator> CachedFirst(
+        std::unique_ptr<FnameIterator> inner, size_t lookahead);
+
+// Wraps inner so that threads pinned with PinToNumaNode prefer files on
+// disks attached to their own node. Files for other nodes are set aside (at
+// most max_pending per node) for threads pinned there to pick up.
+std::unique_ptr<FnameIterator> NumaAffine(
+        std::unique_ptr<FnameIterator> inner, size_t max_pending);
+
+// Wraps inner so that a background thread fetches entries ahead of the
+// workers and asks the kernel to start reading the first prefetch_bytes of
+// each, so that a worker's next file is already partly in the page cache by
+// the time it opens it. At most budget bytes are read ahead of the workers:
+// an entry counts from when it is prefetched until it is Finished, however
+// many wrappers outside this one hold it in between. Entries are handed out
+// in the order inner gives them.
+std::unique_ptr<FnameIterator> Prefetching(
+        std::unique_ptr<FnameIterator> inner, size_t budget,
+        size_t prefetch_bytes);
+
+// Wraps inner so that each block device only has a limited number of files
+// being worked on at once: one for rotational disks and for disks that our
+// cgroup's io.max throttles, and the device's queue depth for everything
+// else. Files whose device is busy are set aside (at
+// most max_pending of them) so that workers can move on to other devices.
+// Files count against their device from GetNext until Finished, so this has
+// to be the outermost wrapper.
+std::unique_ptr<FnameIterator> DeviceLimited(
+        std::unique_ptr<FnameIterator> inner, size_t max_pending);
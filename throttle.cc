@@ -0,0 +1,151 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "throttle.h"
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace {
+int64_t NowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Bursts may use up to this much of a second's allowance at once.
+constexpr double kBurstSeconds = 0.1;
+
+struct Limiters {
+    std::unique_ptr<RateLimiter> bytes;
+    std::unique_ptr<RateLimiter> files;
+};
+
+Limiters MakeLimiters(const ReadLimits& limits) {
+    Limiters ret;
+    if (limits.bytes_per_sec) {
+        // A burst always covers at least one full read buffer.
+        ret.bytes = std::make_unique<RateLimiter>(
+            limits.bytes_per_sec,
+            std::max(limits.bytes_per_sec * kBurstSeconds, 4.0 * (1 << 20)));
+    }
+    if (limits.files_per_sec) {
+        ret.files = std::make_unique<RateLimiter>(
+            limits.files_per_sec,
+            std::max(limits.files_per_sec * kBurstSeconds, 1.0));
+    }
+    return ret;
+}
+
+Limiters& GlobalLimiters() {
+    static Limiters limiters;
+    return limiters;
+}
+
+std::vector<std::pair<dev_t, Limiters>>& DeviceLimiters() {
+    static std::vector<std::pair<dev_t, Limiters>> limiters;
+    return limiters;
+}
+}
+
+RateLimiter::RateLimiter(double rate, double burst)
+    : ns_per_unit_(1e9 / rate),
+      burst_ns_(burst * ns_per_unit_),
+      full_at_ns_(0) {}
+
+void RateLimiter::Acquire(uint64_t amount) {
+    const int64_t cost = amount * ns_per_unit_;
+    const int64_t now = NowNs();
+    int64_t full_at = full_at_ns_.load(std::memory_order_relaxed);
+    int64_t next;
+    do {
+        next = std::max(full_at, now) + cost;
+    } while (!full_at_ns_.compare_exchange_weak(full_at, next,
+                                                std::memory_order_relaxed));
+
+    // We may go once the bucket has room for what we took.
+    const int64_t wait = next - burst_ns_ - now;
+    if (wait <= 0) return;
+    const struct timespec ts = {
+        .tv_sec = wait / 1000000000LL,
+        .tv_nsec = wait % 1000000000LL,
+    };
+    nanosleep(&ts, nullptr);
+}
+
+void RateLimiter::Refund(uint64_t amount) {
+    full_at_ns_.fetch_sub(amount * ns_per_unit_, std::memory_order_relaxed);
+}
+
+void SetGlobalReadLimits(const ReadLimits& limits) {
+    GlobalLimiters() = MakeLimiters(limits);
+}
+
+void SetDeviceReadLimits(dev_t dev, const ReadLimits& limits) {
+    DeviceLimiters().emplace_back(dev, MakeLimiters(limits));
+}
+
+// static
+ReadThrottle ReadThrottle::ForFd(int fd) {
+    ReadThrottle ret;
+    ret.bytes_[0] = GlobalLimiters().bytes.get();
+    ret.files_[0] = GlobalLimiters().files.get();
+
+    auto& devices = DeviceLimiters();
+    if (!ret.bytes_[0] && !ret.files_[0] && devices.empty()) return ret;
+    struct stat sb;
+    if (fstat(fd, &sb)) return ret;
+    if (S_ISREG(sb.st_mode)) ret.size_ = sb.st_size;
+    for (auto& [dev, limiters] : devices) {
+        if (dev != sb.st_dev) continue;
+        ret.bytes_[1] = limiters.bytes.get();
+        ret.files_[1] = limiters.files.get();
+    }
+    return ret;
+}
+
+void ReadThrottle::Open() {
+    for (auto* limiter : files_) {
+        if (limiter) limiter->Acquire(1);
+    }
+}
+
+size_t ReadThrottle::Read(off_t offset, size_t bytes) {
+    if (size_ >= 0) {
+        bytes = std::min<uint64_t>(bytes, std::max<off_t>(size_ - offset, 0));
+    }
+    if (bytes == 0) return 0;
+    for (auto* limiter : bytes_) {
+        if (limiter) limiter->Acquire(bytes);
+    }
+    return bytes;
+}
+
+void ReadThrottle::Settle(size_t reserved, ssize_t amount) {
+    const size_t used = std::max<ssize_t>(amount, 0);
+    for (auto* limiter : bytes_) {
+        if (!limiter) continue;
+        // More than was reserved means the file grew since ForFd.
+        if (used > reserved) limiter->Acquire(used - reserved);
+        if (used < reserved) limiter->Refund(reserved - used);
+    }
+}
@@ -0,0 +1,76 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+
+// A token bucket shared by every thread, as a generic cell rate algorithm:
+// instead of counting tokens it keeps the time at which the bucket will be
+// full again, so taking tokens is a single compare-and-swap, and waiting
+// threads are served in the order they asked.
+class RateLimiter {
+  public:
+    // Allows rate units per second, with bursts of up to burst units.
+    RateLimiter(double rate, double burst);
+
+    // Takes amount units, sleeping until they are available.
+    void Acquire(uint64_t amount);
+    // Gives back units that were acquired but not used.
+    void Refund(uint64_t amount);
+
+  private:
+    const double ns_per_unit_;
+    const int64_t burst_ns_;
+    std::atomic<int64_t> full_at_ns_;
+};
+
+// Limits on reading; zero is unlimited.
+struct ReadLimits {
+    uint64_t bytes_per_sec = 0;
+    uint64_t files_per_sec = 0;
+};
+
+// Configure limits for all reads, and for reads from the device dev. Must be
+// called before any file is opened.
+void SetGlobalReadLimits(const ReadLimits& limits);
+void SetDeviceReadLimits(dev_t dev, const ReadLimits& limits);
+
+// The limiters that apply to one open file.
+class ReadThrottle {
+  public:
+    static ReadThrottle ForFd(int fd);
+
+    // Waits until another file may be opened.
+    void Open();
+    // Waits until a read of up to bytes at offset may go ahead, and returns
+    // how many bytes it reserved: no more than the file had left when ForFd
+    // looked, so none for the read that finds its end.
+    size_t Read(off_t offset, size_t bytes);
+    // Settles a Read() that reserved bytes with the read that followed, which
+    // got amount (or failed, if negative): gives back what it did not use,
+    // and takes what it got past what the file held before.
+    void Settle(size_t reserved, ssize_t amount);
+
+  private:
+    RateLimiter* bytes_[2] = {};
+    RateLimiter* files_[2] = {};
+    // The file's size, if there are limits to apply and it is a regular file.
+    off_t size_ = -1;
+};
@@ -0,0 +1,146 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#include "tuning.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+#include "common.h"
+
+namespace {
+constexpr auto kWindow = std::chrono::milliseconds(500);
+
+// A file costs about as much as reading this many bytes, so that trees of
+// small files are not scored as having no throughput.
+constexpr uint64_t kBytesPerFile = 64 << 10;
+
+// Changes in throughput smaller than this fraction are treated as noise.
+constexpr double kTolerance = 0.05;
+}
+
+WorkerGate::WorkerGate(int level)
+    : level_(level),
+      cap_(std::numeric_limits<int>::max()),
+      limit_(level) {}
+
+void WorkerGate::Wait(int index) {
+    if (index < limit_.load(std::memory_order_relaxed)) return;
+    std::unique_lock<std::mutex> l(mu_);
+    cv_.wait(l, [&]() { return open_ || index < limit_.load(); });
+}
+
+void WorkerGate::SetLevel(int level) {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        level_ = level;
+        Update();
+    }
+    cv_.notify_all();
+}
+
+void WorkerGate::SetCap(int cap) {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        cap_ = cap;
+        Update();
+    }
+    cv_.notify_all();
+}
+
+int WorkerGate::level() const {
+    const std::lock_guard<std::mutex> l(mu_);
+    return level_;
+}
+
+void WorkerGate::Open() {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        open_ = true;
+        Update();
+    }
+    cv_.notify_all();
+}
+
+void WorkerGate::Update() {
+    if (open_) {
+        limit_.store(std::numeric_limits<int>::max());
+        return;
+    }
+    limit_.store(std::min(level_, cap_));
+}
+
+AutoTuner::AutoTuner(WorkerGate* gate, int max_level)
+    : gate_(gate), max_level_(max_level) {}
+
+AutoTuner::~AutoTuner() { Stop(); }
+
+void AutoTuner::Start() { thread_ = std::thread(&AutoTuner::Run, this); }
+
+void AutoTuner::Stop() {
+    {
+        const std::lock_guard<std::mutex> l(mu_);
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+
+void AutoTuner::Run() {
+    auto* const counters = GlobalCounters();
+    uint64_t last_bytes = counters->bytes_hashed.load();
+    uint64_t last_files = counters->files_done.load();
+    double last_score = 0;
+    int direction = 1;
+
+    std::unique_lock<std::mutex> l(mu_);
+    while (!cv_.wait_for(l, kWindow, [this]() { return stopped_; })) {
+        const uint64_t bytes = counters->bytes_hashed.load();
+        const uint64_t files = counters->files_done.load();
+        const uint64_t new_bytes = bytes - last_bytes;
+        const uint64_t new_files = files - last_files;
+        last_bytes = bytes;
+        last_files = files;
+
+        // Keep going while things improve, turn around when they get worse,
+        // and stay put while the change is lost in the noise.
+        const double score = new_bytes + new_files * kBytesPerFile;
+        const bool better = score > last_score * (1 + kTolerance);
+        const bool worse = score < last_score * (1 - kTolerance);
+        last_score = score;
+        if (worse) direction = -direction;
+        if (!better && !worse) continue;
+
+        const int level = gate_->level();
+        const int next = std::clamp(level + direction, 1, max_level_);
+        // Bounce off the limits rather than sitting at them.
+        if (next == level) direction = -direction;
+        if (next == level) continue;
+
+        gate_->SetLevel(next);
+        const double seconds =
+            std::chrono::duration<double>(kWindow).count();
+        WriteLocked(stderr, "auto-threads: %d workers "
+                            "(%.1f MB/s, %.0f files/s)\n",
+                    next, new_bytes / seconds / 1e6, new_files / seconds);
+    }
+}
@@ -0,0 +1,76 @@
+// This file is part of Hasher.
+//
+// Hasher is free software: you can redistribute it and/or modify it under the
+// terms of the GNU General Public License as published by the Free Software
+// Foundation, either version 3 of the License, or (at your option) any later
+// version.
+//
+// Hasher is distributed in the hope that it will be useful, but WITHOUT ANY
+// WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+// FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+// details.
+//
+// You should have received a copy of the GNU General Public License along with
+// Hasher. If not, see <https://www.gnu.org/licenses/>.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// Lets only the first level workers run; the others park until the level is
+// raised again. A cap set independently of the level (to back off under
+// pressure, say) further limits how many workers run.
+class WorkerGate {
+  public:
+    explicit WorkerGate(int level);
+
+    // Blocks while worker number index is above the current level or cap.
+    void Wait(int index);
+    void SetLevel(int level);
+    void SetCap(int cap);
+    int level() const;
+
+    // Lets every worker through for good, so that parked workers can notice
+    // that there is no work left.
+    void Open();
+
+  private:
+    // Recomputes limit_. Requires mu_.
+    void Update();
+
+    int level_;
+    int cap_;
+    // The smaller of level_ and cap_, readable without mu_.
+    std::atomic<int> limit_;
+    bool open_ = false;
+
+    mutable std::mutex mu_;
+    std::condition_variable cv_;
+};
+
+// Hill-climbs the level of a WorkerGate between 1 and max_level, following
+// the throughput in GlobalCounters() over short windows, and logs each level
+// it picks to stderr.
+class AutoTuner {
+  public:
+    AutoTuner(WorkerGate* gate, int max_level);
+    ~AutoTuner();
+
+    void Start();
+    void Stop();
+
+  private:
+    void Run();
+
+    WorkerGate* const gate_;
+    const int max_level_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    bool stopped_ = false;
+
+    std::thread thread_;
+};
@@ -15,17 +15,37 @@
 
 #pragma once
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include <string>
 #include <memory>
+#include <vector>
+
+#include "digest.h"
 
-std::string HashToString(const std::vector<uint8_t>& bytes);
+std::string HashToString(const Digest& digest);
+
+// A file handed out by an FnameIterator. An empty path marks the end of the
+// iteration. size is -1 when the iterator did not stat the file, in which case
+// dev is meaningless too. seq numbers files in the order they were found,
+// from 0 and without gaps.
+struct FnameEntry {
+    std::string path;
+    off_t size = -1;
+    dev_t dev = 0;
+    uint64_t seq = 0;
+};
 
 class FnameIterator {
   public:
     static std::unique_ptr<FnameIterator> GetInstance(bool recurse,
             char** args);
     virtual ~FnameIterator();
-    virtual std::string GetNext() = 0;
+    virtual FnameEntry GetNext() = 0;
     virtual void Start() = 0;
+
+    // Called once a worker is done with an entry returned by GetNext.
+    virtual void Finished(const FnameEntry& entry);
 };
 